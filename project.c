@@ -7,7 +7,18 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/wait.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <signal.h>
 #include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <errno.h>
+#include <stdarg.h>
 
 //End of String. Used with sprintf to get the pointer of string buffer.
 #define eos(s) ((s)+strlen(s))
@@ -20,6 +31,26 @@ enum FileType {
     FILE_TYPE_SYMBOLIC_LINK
 };
 
+// Holds an estimated directory size and file count with the half widths of their 95% confidence intervals
+typedef struct sizeEstimate {
+    double size;
+    double size_error;
+    double files;
+    double files_error;
+    int samples;
+    int exact;
+} SizeEstimate;
+
+// Holds the scores of the .c files graded in one directory, compiles stopped by a limit are only counted
+typedef struct gradeSummary {
+    const char *path;
+    int count;
+    int limited;
+    double sum;
+    double min;
+    double max;
+} GradeSummary;
+
 // Holds Directory information
 typedef struct dirResult {
     const char *path;
@@ -27,8 +58,24 @@ typedef struct dirResult {
     off_t size;
     int access;
     int c_files;
+    SizeEstimate estimate;
+    GradeSummary grades;
+    char *grade_report;
 } DirResult;
 
+// Holds a directory reached by the size sampling. Its entries are read once and kept, a complete
+// directory has had its whole subtree read and knows its exact totals.
+typedef struct estimateNode {
+    char *path;
+    int depth;
+    int listed;
+    int complete;
+    double bytes;
+    double files;
+    int child_count;
+    struct estimateNode **children;
+} EstimateNode;
+
 // Holds Symbolic link information
 typedef struct symbolicResult {
     const char *path;
@@ -39,6 +86,33 @@ typedef struct symbolicResult {
     int deleted;
 } SymbolicResult;
 
+// Kinds of traversal filter rules
+enum FilterKind {
+    FILTER_EXCLUDE,
+    FILTER_INCLUDE
+};
+
+// Holds a compiled include or exclude rule. Globs match the entry name, regexes match the path.
+typedef struct filterRule {
+    enum FilterKind kind;
+    int is_regex;
+    char *glob;
+    regex_t regex;
+} FilterRule;
+
+// Holds the traversal filters entered by user for Directory
+typedef struct dirFilter {
+    FilterRule *rules;
+    int rule_count;
+    int include_count;
+    int max_depth;
+    off_t min_size;
+    off_t max_size;
+    time_t newer_than;
+    time_t older_than;
+    char *text;
+} DirFilter;
+
 // Holds the options entered by user for Directory
 typedef struct diroptions {
     const char *path;
@@ -46,6 +120,10 @@ typedef struct diroptions {
     int size;
     int perms;
     int c_files;
+    DirFilter *filter;
+    int one_filesystem;
+    int estimate_ms;
+    int grade;
 } DirOptions;
 
 // Holds the options entered by user for Symbolic link
@@ -68,6 +146,12 @@ typedef struct fileoptions{
     int perms;
     int symbolic;
     const char *symbolic_name;
+    int graded;
+    double score;
+    int words;
+    int bytes;
+    int longest_line;
+    int utf8;
 } FileOptions;
 
 // Holds regular file information
@@ -81,10 +165,318 @@ typedef struct fileresult{
     time_t mtime;
 } FileResult;
 
+// Fields a report can ask for, X(field, bit, needs stat). A field needs stat when it is read from
+// the stat of the path itself, the handlers leave the stat out when no selected field needs it.
+#define FILE_FIELDS(X) \
+    X(FILE_FIELD_NAME, 0, 0) \
+    X(FILE_FIELD_SIZE, 1, 1) \
+    X(FILE_FIELD_PERMS, 2, 1) \
+    X(FILE_FIELD_HARD_LINK, 3, 1) \
+    X(FILE_FIELD_MTIME, 4, 1)
+#define SYM_FIELDS(X) \
+    X(SYM_FIELD_NAME, 0, 0) \
+    X(SYM_FIELD_SIZE, 1, 1) \
+    X(SYM_FIELD_PERMS, 2, 1) \
+    X(SYM_FIELD_TARGET_SIZE, 3, 0)
+#define DIR_FIELDS(X) \
+    X(DIR_FIELD_NAME, 0, 0) \
+    X(DIR_FIELD_PERMS, 1, 1)
+
+#define FIELD_MASK(field, bit, stat) field = 1 << bit,
+#define FIELD_STAT(field, bit, stat) | (stat << bit)
+#define FIELD_COUNT(field, bit, stat) + 1
+enum FileField { FILE_FIELDS(FIELD_MASK) };
+enum SymField { SYM_FIELDS(FIELD_MASK) };
+enum DirField { DIR_FIELDS(FIELD_MASK) };
+#define FILE_STAT_FIELDS (0 FILE_FIELDS(FIELD_STAT))
+#define SYM_STAT_FIELDS (0 SYM_FIELDS(FIELD_STAT))
+#define DIR_STAT_FIELDS (0 DIR_FIELDS(FIELD_STAT))
+#define FILE_HANDLER_COUNT (1 << (0 FILE_FIELDS(FIELD_COUNT)))
+#define SYM_HANDLER_COUNT (1 << (0 SYM_FIELDS(FIELD_COUNT)))
+#define DIR_HANDLER_COUNT (1 << (0 DIR_FIELDS(FIELD_COUNT)))
+
+// Expand M once for every mask of the given bit width in increasing order, GEN_MASKS2(M) gives
+// M(0) M(1) M(2) M(3). Handlers are generated with it, one per field mask.
+#define GEN_MASKS2(M) M(0) M(1) M(2) M(3)
+#define GEN_MASKS4(M) GEN_MASKS2(M) M(4) M(5) M(6) M(7) M(8) M(9) M(10) M(11) M(12) M(13) M(14) M(15)
+#define GEN_MASKS5(M) GEN_MASKS4(M) M(16) M(17) M(18) M(19) M(20) M(21) M(22) M(23) \
+    M(24) M(25) M(26) M(27) M(28) M(29) M(30) M(31)
+
+// Holds the resource limits of a grading compile, 0 means no limit
+typedef struct gradeLimits {
+    long memory_mb;
+    long cpu_seconds;
+    long output_mb;
+    long wall_seconds;
+} GradeLimits;
+
+// Holds the run-wide options entered before the paths
+typedef struct runoptions {
+    int dedup;
+    int one_filesystem;
+    int hdd_jobs;
+    int ssd_jobs;
+    long max_stats;
+    long long max_read_bytes;
+    int idle_io;
+    const char *checkpoint_file;
+    int checkpoint_interval;
+    int resume;
+    const char *snapshot_file;
+    int diff;
+    int grade_batch;
+    GradeLimits limits;
+} RunOptions;
+
+// Holds the extra gcc settings of a compile, NULL fields keep the defaults
+typedef struct compileoptions {
+    const char *include_dir;
+    const char *output;
+} CompileOptions;
+
+// Scores given instead of a grade when a compile breaks a resource limit
+#define SCORE_LIMIT_MEMORY -1
+#define SCORE_LIMIT_CPU -2
+#define SCORE_LIMIT_OUTPUT -3
+#define SCORE_LIMIT_TIME -4
+
+// Number of submissions checked by one gcc syntax-only run in batch grading
+#define GRADE_BATCH_SIZE 64
+
+// Holds a .c file sent to a grading worker, the record is written to the pipe in one atomic write
+typedef struct gradeTask {
+    int id;
+    char path[PIPE_BUF - sizeof(int)];
+} GradeTask;
+
+// Holds the score a grading worker sends back
+typedef struct gradeReply {
+    int id;
+    double score;
+} GradeReply;
+
+// Holds the pipes and output directory shared by the workers of a recursive grading walk
+typedef struct gradeWorker {
+    int *task_pipe;
+    int *reply_pipe;
+    const char *dir;
+} GradeWorker;
+
+// Holds the state of a recursive grading walk. The tasks remember their path and directory until
+// their score comes back, the first summary is the total.
+typedef struct gradeWalk {
+    GradeSummary *dirs;
+    int dir_count;
+    char **task_paths;
+    int *task_dirs;
+    int task_count;
+    int pending;
+    int task_fd;
+    int reply_fd;
+} GradeWalk;
+
+// Holds a rate limit shared by all child processes. next_ns is the time the next unit is allowed.
+typedef struct rateBucket {
+    long long next_ns;
+    long long rate;
+} RateBucket;
+
+// Holds the stat and read rate limits, placed in shared memory
+typedef struct ioThrottle {
+    RateBucket stats;
+    RateBucket bytes;
+} IoThrottle;
+
+// Unused budget is kept for at most this long, so idle time allows only a short burst
+#define THROTTLE_BURST_NS 100000000LL
+// Block size used to read file contents
+#define READ_BLOCK_SIZE (64 * 1024)
+// Number of upcoming files whose contents are requested ahead of their scan
+#define PREFETCH_DEPTH 16
+// At most this much of an upcoming file is requested ahead
+#define PREFETCH_BYTES (2 * 1024 * 1024)
+// Number of scan buffers a process keeps for reuse
+#define SCAN_BUFFER_POOL 4
+
+// Holds a read buffer kept for reuse by the content scans of a process
+typedef struct scanBuffer {
+    unsigned char *data;
+    size_t size;
+    int in_use;
+} ScanBuffer;
+// ioprio_set constants, glibc has no header for them
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+// Counters the text statistics engine can be asked for, lines and bytes are always counted
+#define TEXT_WORDS 1
+#define TEXT_LONGEST_LINE 2
+#define TEXT_UTF8 4
+#define TEXT_SELECTIONS 8
+
+// Holds the statistics of a text file
+typedef struct textStats {
+    long long lines;
+    long long words;
+    long long bytes;
+    long long longest_line;
+    int non_utf8;
+} TextStats;
+
+// Holds the scan state carried from one block to the next
+typedef struct textScanState {
+    int in_word;
+    long long line_length;
+    int utf8_need;          // continuation bytes still expected
+    unsigned char utf8_low; // allowed range of the next continuation byte
+    unsigned char utf8_high;
+} TextScanState;
+
+// Byte vectors for the word scan, a compare gives 0 or -1 in each lane
+typedef unsigned char ByteVector __attribute__((vector_size(16)));
+typedef signed char ByteMask __attribute__((vector_size(16)));
+
+// Holds the header of a snapshot file
+typedef struct snapshotHeader {
+    char magic[8];
+    unsigned long long count;
+    unsigned long long strings_offset;
+    unsigned long long strings_size;
+} SnapshotHeader;
+
+// Holds one path of a snapshot. The records are sorted by path and the NUL terminated paths
+// are stored in the same order in a string table after them.
+typedef struct snapshotRecord {
+    unsigned long long path_offset;
+    unsigned long long inode;
+    long long size;
+    long long mtime;
+    unsigned int mode;
+    int hard_link;
+    int c_files;
+    int reserved;
+} SnapshotRecord;
+
+// Holds a snapshot path while sorting
+typedef struct snapshotSortEntry {
+    const char *path;
+    int index;
+} SnapshotSortEntry;
+
+#define SNAPSHOT_MAGIC "OPSNAP1"
+
+// Positions of a path relative to the saved frontier of a resumed walk
+#define WALK_BEFORE -1
+#define WALK_SAME 0
+#define WALK_AFTER 1
+#define WALK_ANCESTOR 2
+
+// I/O limits of the run, NULL when not throttled
+IoThrottle *io_throttle = NULL;
+
+// Holds a line of the checkpoint file. Types: S directory size, P walk progress, C .c file count, G grade.
+typedef struct checkpointRecord {
+    char type;
+    char *path;
+    char *signature;
+    long long value;
+    double score;
+    char *frontier;
+} CheckpointRecord;
+
+// Holds the checkpoint file of the run and the records loaded from it on resume
+typedef struct checkpoint {
+    const char *file;
+    int fd;
+    int interval;
+    CheckpointRecord *records;
+    int record_count;
+} Checkpoint;
+
+// Checkpoint of the run, NULL when not checkpointing
+Checkpoint *checkpoint = NULL;
+
+// Resource limits of every grading compile
+GradeLimits grade_limits = {2048, 30, 64, 120};
+
+// Read buffers of this process, a forked child gets its own copy
+ScanBuffer scan_buffers[SCAN_BUFFER_POOL];
+
+// Holds a path with its entered options until its child process is started
+typedef struct job {
+    char *path;
+    enum FileType type;
+    dev_t dev;
+    DirOptions dir_opts;
+    SymbolicOptions sym_opts;
+    FileOptions file_opts;
+    pid_t pid;
+    int prefetched;
+} Job;
+
+// Holds the number of running jobs on a device and how many may run at once
+typedef struct deviceSlot {
+    dev_t dev;
+    int limit;
+    int running;
+} DeviceSlot;
+
+// Holds a regular file found by the duplicate search
+typedef struct dupEntry {
+    FileResult file;
+    dev_t dev;
+    ino_t ino;
+} DupEntry;
+
+// Holds a 128-bit content hash of a file
+typedef struct contentHash {
+    unsigned long long h1;
+    unsigned long long h2;
+} ContentHash;
+
+// Holds a duplicate candidate and its hash while grouping
+typedef struct dupCandidate {
+    int index;
+    off_t size;
+    ContentHash hash;
+} DupCandidate;
+
+// Holds a loop run by parallel_for, next is the shared index of the next item
+typedef struct parallelLoop {
+    int *next;
+    int items;
+    void (*item)(int, int, void *);
+    void *arg;
+} ParallelLoop;
+
+// Holds the files compiled by the worker pool of grade_files_batch, scores is in shared memory
+typedef struct compileJob {
+    char **paths;
+    int *pending;
+    double *scores;
+    const char *dir;
+    const char *include_dir;
+} CompileJob;
+
+// Holds the entries hashed by hash_files_parallel, hashes is in shared memory
+typedef struct hashJob {
+    DupEntry *entries;
+    int *indexes;
+    int count;
+    off_t limit;
+    ContentHash *hashes;
+} HashJob;
+
+// Number of leading bytes hashed before the full content hash
+#define DUP_PARTIAL_BYTES 4096
+// Read size used when a file can't be mapped
+#define DUP_READ_BUFFER (1 << 20)
+
 char* print_permissions(int);
-off_t calculate_directory_size(char *);
+off_t calculate_directory_size(char *, const DirFilter *, int);
 char *get_folder_name(const char *);
-enum FileType getFileType(const char *);
+enum FileType getFileType(const char *, struct stat *);
 int create_file(char *, char *);
 long int calculate_symlink_target_size(char *);
 int set_file_permissions(const char *, int);
@@ -95,75 +487,298 @@ SymbolicOptions GetSymbolicOptions(char *);
 FileOptions GetFileOptions(char *);
 void PrintFileInfo(char *, int *, FileOptions);
 int check_file_extension (const char *, const char *);
-int count_lines_in_file(const char *);
-double compile_file_in_child(char *);
+int count_text_stats(const char *, int, TextStats *);
+double compile_file_in_child(char *, const CompileOptions *);
+RunOptions GetRunOptions(int, char **, int *);
+long long parse_byte_count(const char *);
+void find_duplicate_files(char **, int, int);
+int is_rotational_device(dev_t);
+pid_t start_job(Job *, int *);
+IoThrottle *create_io_throttle(const RunOptions *);
+void throttle_stats(long);
+void throttle_bytes(long long);
+void prefetch_file(const char *, off_t);
+unsigned char *take_scan_buffer(size_t);
+void give_scan_buffer(unsigned char *);
+int worker_count(int);
+pid_t *start_workers(int, void (*)(int, void *), void *);
+void wait_workers(pid_t *, int);
+void parallel_for(int, void (*)(int, int, void *), void *);
+int make_temp_dir(char *, size_t);
+Checkpoint *open_checkpoint(const char *, int, int);
+const CheckpointRecord *checkpoint_find_in(const Checkpoint *, char, const char *, const char *);
+const CheckpointRecord *checkpoint_find(char, const char *, const char *);
+void checkpoint_append(const char *, ...);
+char *walk_signature(const DirFilter *, int);
+int walk_position(const char *, const char *, size_t);
+int compare_fts_names(const FTSENT **, const FTSENT **);
+int save_snapshot(const char *, char **, int, int);
+SizeEstimate estimate_directory_size(const char *, const DirFilter *, int, int);
+void grade_files_batch(char **, int, double *);
+const char *score_limit_name(double);
+int create_grade_cgroup(char *, size_t);
+int write_text_file(const char *, const char *);
+GradeSummary grade_directory(const char *, const DirFilter *, int, char **);
+void apply_grade_rlimits(void);
+double calculateScore(int, int);
+int compile_tool_message(const char *, const char *, const char *);
+int compile_ran_out_of_memory(const char *);
+int diff_snapshots(const char *, const char *);
+int add_filter_rule(DirFilter *, const char *);
+int filter_skip_dir(const DirFilter *, const char *, const char *, int);
+int filter_match_file(const DirFilter *, const char *, const char *, const struct stat *);
 
 int main(int argc, char *argv[]) {
+    // Parse the run-wide options, paths start at argv[first]
+    int first;
+    RunOptions run_opts = GetRunOptions(argc, argv, &first);
+    grade_limits = run_opts.limits;
+    // Set up the I/O limits before any child process is created so they all share them
+    io_throttle = create_io_throttle(&run_opts);
+    if (run_opts.checkpoint_file) {
+        checkpoint = open_checkpoint(run_opts.checkpoint_file, run_opts.resume, run_opts.checkpoint_interval);
+    } else if (run_opts.resume) {
+        fprintf(stderr, "Error: --resume needs --checkpoint=FILE\n");
+        exit(EXIT_FAILURE);
+    }
+    if (run_opts.idle_io && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+        perror("ioprio_set");
+    }
+    if (run_opts.dedup) {
+        find_duplicate_files(argv + first, argc - first, run_opts.one_filesystem);
+        return 0;
+    }
+    if (run_opts.snapshot_file) {
+        return save_snapshot(run_opts.snapshot_file, argv + first, argc - first, run_opts.one_filesystem);
+    }
+    if (run_opts.diff) {
+        if (argc - first != 2) {
+            fprintf(stderr, "Error: --diff needs two snapshot files\n");
+            return EXIT_FAILURE;
+        }
+        return diff_snapshots(argv[first], argv[first + 1]);
+    }
     // Allocate a shared memory to control child process's start time.
     int *start = mmap ( NULL, sizeof(int),
                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0 );
     // Set start to 0 until the options for all paths are entered
     *start = 0;
-    DirOptions dir_opts;
-    SymbolicOptions sym_opts;
-    FileOptions file_opts;
-    int fd[2];
-    pid_t p;
-    pipe(fd);
-    // loop through all args and create a child process according to the file type
-    for (int i = 1; i < argc; i++) {
-        switch (getFileType(argv[i])) {
+    Job *jobs = (Job *) calloc(argc, sizeof(Job));
+    DeviceSlot *slots = (DeviceSlot *) calloc(argc, sizeof(DeviceSlot));
+    int job_count = 0, slot_count = 0;
+    struct stat st_path;
+    // loop through all args and get the options according to the file type
+    for (int i = first; i < argc; i++) {
+        Job *job = &jobs[job_count];
+        job->path = argv[i];
+        job->type = getFileType(argv[i], &st_path);
+        switch (job->type) {
             case FILE_TYPE_UNKNOWN:
-                break;
+                continue;
             case FILE_TYPE_FILE:
-                file_opts = GetFileOptions(argv[i]);
-                p = fork();
-                if (p > 0){
-                    continue;
-                } else if (p == 0){
-                    PrintFileInfo(argv[i], start, file_opts);
-                    exit(0);
-                } else {
-                    printf("Error");
-                    exit(0);
-                }
+                job->file_opts = GetFileOptions(argv[i]);
+                break;
             case FILE_TYPE_SYMBOLIC_LINK:
-                sym_opts = GetSymbolicOptions(argv[i]);
-                p = fork();
-                if (p > 0){
-                    continue;
-                } else if (p == 0){
-                    PrintSymInfo(argv[i], start, sym_opts);
-                    exit(0);
-                } else {
-                    printf("Error");
-                    exit(0);
-                }
+                job->sym_opts = GetSymbolicOptions(argv[i]);
+                break;
             case FILE_TYPE_DIRECTORY:
-                dir_opts = GetDirectoryOptions(argv[i]);
-                p = fork();
-                if (p > 0){
-                    continue;
-                } else if (p == 0){
-                    PrintDirInfo(argv[i], start, dir_opts);
-                    exit(0);
-                } else {
-                    printf("Error");
-                    exit(0);
-                }
+                job->dir_opts = GetDirectoryOptions(argv[i]);
+                job->dir_opts.one_filesystem = run_opts.one_filesystem;
+                break;
+        }
+        // Group the jobs by the device they are on
+        job->dev = st_path.st_dev;
+        int s;
+        for (s = 0; s < slot_count && slots[s].dev != job->dev; s++);
+        if (s == slot_count) {
+            slots[s].dev = job->dev;
+            slots[s].limit = is_rotational_device(job->dev) ? run_opts.hdd_jobs : run_opts.ssd_jobs;
+            slot_count++;
+        }
+        job_count++;
+    }
+    if (run_opts.grade_batch) {
+        // Grade all .c files together before the jobs start, files graded by an earlier run are left out
+        char **grade_paths = (char **) malloc((job_count + 1) * sizeof(char *));
+        double *grade_scores = (double *) malloc((job_count + 1) * sizeof(double));
+        int grade_count = 0;
+        for (int j = 0; j < job_count; j++) {
+            if (jobs[j].type == FILE_TYPE_FILE && check_file_extension(jobs[j].path, ".c")
+                && !checkpoint_find('G', jobs[j].file_opts.path, NULL)) {
+                grade_paths[grade_count++] = (char *) jobs[j].file_opts.path;
+            }
+        }
+        grade_files_batch(grade_paths, grade_count, grade_scores);
+        for (int j = 0, k = 0; j < job_count && k < grade_count; j++) {
+            if (jobs[j].file_opts.path == grade_paths[k]) {
+                jobs[j].file_opts.graded = 1;
+                jobs[j].file_opts.score = grade_scores[k++];
+            }
         }
+        free(grade_scores);
+        free(grade_paths);
     }
-    // set start to 1 to start all the child process at the same time
+    // set start to 1, the child processes start as soon as their device has a free slot
     *start = 1;
-    int st;
+    int st, finished = 0, next = 0;
     pid_t p2;
-    // Wait for all child process to end
-    for (int i = 1; i < argc; i++){
+    while (finished < job_count) {
+        // Start every waiting job whose device isn't at its limit, in the order of the args
+        for (int j = next; j < job_count; j++) {
+            int s;
+            if (jobs[j].pid != 0) {
+                continue;
+            }
+            for (s = 0; slots[s].dev != jobs[j].dev; s++);
+            if (slots[s].running < slots[s].limit) {
+                jobs[j].pid = start_job(&jobs[j], start);
+                slots[s].running++;
+            }
+        }
+        while (next < job_count && jobs[next].pid != 0) {
+            next++;
+        }
+        // Start reading the files of the next waiting jobs, their children then find them cached
+        for (int j = next, ahead = 0; j < job_count && ahead < PREFETCH_DEPTH; j++) {
+            if (jobs[j].pid != 0 || jobs[j].type != FILE_TYPE_FILE || jobs[j].file_opts.graded) {
+                continue;
+            }
+            if (!jobs[j].prefetched) {
+                prefetch_file(jobs[j].path, 0);
+                jobs[j].prefetched = 1;
+            }
+            ahead++;
+        }
+        // Wait for a child process to end and free its slot
         p2 = wait(&st);
+        if (p2 < 0) {
+            break;
+        }
         printf("Process with PID %d exited with code %d\n", p2, st);
+        for (int j = 0; j < job_count; j++) {
+            if (jobs[j].pid == p2) {
+                int s;
+                for (s = 0; slots[s].dev != jobs[j].dev; s++);
+                slots[s].running--;
+                finished++;
+                break;
+            }
+        }
+    }
+    free(slots);
+    free(jobs);
+}
+
+// Start the child process of a job and return its PID
+pid_t start_job(Job *job, int *start) {
+    // Flush so the child doesn't print the parent's buffered output again
+    fflush(stdout);
+    pid_t p = fork();
+    if (p > 0) {
+        return p;
+    } else if (p < 0) {
+        printf("Error");
+        exit(0);
     }
+    switch (job->type) {
+        case FILE_TYPE_FILE:
+            PrintFileInfo(job->path, start, job->file_opts);
+            break;
+        case FILE_TYPE_SYMBOLIC_LINK:
+            PrintSymInfo(job->path, start, job->sym_opts);
+            break;
+        case FILE_TYPE_DIRECTORY:
+            PrintDirInfo(job->path, start, job->dir_opts);
+            break;
+        default:
+            break;
+    }
+    exit(0);
 }
 
+// Get the run-wide options given before the paths and return a RunOptions structure
+RunOptions GetRunOptions(int argc, char *argv[], int *first){
+    RunOptions opts = {0};
+    int i;
+    // Spinning disks get one walker at a time, other devices get two per CPU
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts.hdd_jobs = 1;
+    opts.ssd_jobs = cpus > 0 ? 2 * cpus : 2;
+    opts.checkpoint_interval = 10;
+    opts.limits = grade_limits;
+    // Loop through the leading "--" arguments, a lone "--" ends the options
+    for (i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            opts.dedup = 1;
+        } else if (strncmp(argv[i], "--max-stats=", 12) == 0 && atol(argv[i] + 12) > 0) {
+            opts.max_stats = atol(argv[i] + 12);
+        } else if (strncmp(argv[i], "--max-read=", 11) == 0 && parse_byte_count(argv[i] + 11) > 0) {
+            opts.max_read_bytes = parse_byte_count(argv[i] + 11);
+        } else if (strncmp(argv[i], "--checkpoint=", 13) == 0 && argv[i][13] != '\0') {
+            opts.checkpoint_file = argv[i] + 13;
+        } else if (strncmp(argv[i], "--checkpoint-interval=", 22) == 0 && atoi(argv[i] + 22) > 0) {
+            opts.checkpoint_interval = atoi(argv[i] + 22);
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            opts.resume = 1;
+        } else if (strcmp(argv[i], "--idle-io") == 0) {
+            opts.idle_io = 1;
+        } else if (strncmp(argv[i], "--snapshot=", 11) == 0 && argv[i][11] != '\0') {
+            opts.snapshot_file = argv[i] + 11;
+        } else if (strcmp(argv[i], "--diff") == 0) {
+            opts.diff = 1;
+        } else if (strncmp(argv[i], "--max-mem=", 10) == 0) {
+            opts.limits.memory_mb = atol(argv[i] + 10);
+        } else if (strncmp(argv[i], "--max-cpu=", 10) == 0) {
+            opts.limits.cpu_seconds = atol(argv[i] + 10);
+        } else if (strncmp(argv[i], "--max-output=", 13) == 0) {
+            opts.limits.output_mb = atol(argv[i] + 13);
+        } else if (strncmp(argv[i], "--compile-timeout=", 18) == 0) {
+            opts.limits.wall_seconds = atol(argv[i] + 18);
+        } else if (strcmp(argv[i], "--grade-batch") == 0) {
+            opts.grade_batch = 1;
+        } else if (strcmp(argv[i], "--xdev") == 0) {
+            opts.one_filesystem = 1;
+        } else if (strncmp(argv[i], "--hdd-jobs=", 11) == 0 && atoi(argv[i] + 11) > 0) {
+            opts.hdd_jobs = atoi(argv[i] + 11);
+        } else if (strncmp(argv[i], "--ssd-jobs=", 11) == 0 && atoi(argv[i] + 11) > 0) {
+            opts.ssd_jobs = atoi(argv[i] + 11);
+        } else {
+            fprintf(stderr, "Error: Invalid option %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    *first = i;
+    return opts;
+}
+// Parse a byte count with an optional K, M or G suffix. Returns -1 if invalid.
+long long parse_byte_count(const char *text) {
+    char *end;
+    long long count = strtoll(text, &end, 10);
+    switch (*end) {
+        case 'K':
+        case 'k':
+            count <<= 10;
+            end++;
+            break;
+        case 'M':
+        case 'm':
+            count <<= 20;
+            end++;
+            break;
+        case 'G':
+        case 'g':
+            count <<= 30;
+            end++;
+            break;
+    }
+    if (end == text || *end != '\0') {
+        return -1;
+    }
+    return count;
+}
 // Get options for symbolic link and return a SymbolicOptions structure
 SymbolicOptions GetSymbolicOptions(char *dirPath){
     char options[6] = {'n', 'l', 'd', 't', 'a', '\0'};
@@ -229,41 +844,56 @@ SymbolicOptions GetSymbolicOptions(char *dirPath){
     opts.delete = lFlag;
     return opts;
 }
-// Get Symbolic link information and return a SymbolicResult structure
-SymbolicResult getSymInfo(SymbolicOptions opts){
-    // Using stat struct to hold the link info
-    struct stat dirStat;
-    int nFlag = opts.name;
-    int aFlag = opts.perms;
-    int dFlag = opts.size;
-    int tFlag = opts.target_size;
-    int lFlag = opts.delete;
-    char *dirPath = strdup(opts.path);
-    // Using lstat to get the data of the symbolic link
-    lstat(dirPath, &dirStat);
-    SymbolicResult *res = (SymbolicResult *) malloc(sizeof(struct symbolicResult));
-    res->path = strdup(dirPath);
-    // Get the required link info according to the saved options and return a SymbolicResult structure
-    if (lFlag){
-        unlink(dirPath);
-        res->deleted = 1;
-        return *res;
+// Fill a link record with the fields in mask and append their report lines to out, the link is only
+// stat'ed when a field needs it. Always inlined with a constant mask by the handlers below.
+static inline __attribute__((always_inline)) void fill_sym_fields(const char *path, int mask, SymbolicResult *res,
+                                                                  char *out) {
+    struct stat linkStat;
+    res->path = path;
+    res->deleted = 0;
+    res->size = -1;
+    if (mask & SYM_STAT_FIELDS) {
+        throttle_stats(1);
+        lstat(path, &linkStat);
     }
-    if (nFlag) {
-        res->name = strdup(get_folder_name(dirPath));
+    if (mask & SYM_FIELD_NAME) {
+        res->name = get_folder_name(path);
+        sprintf(eos(out), "Symbolic link Name: %s\n", res->name);
     }
-    if (dFlag == 0) {
-        res->size = dirStat.st_size;
-    } else {
-        res->size = -1;
+    if (mask & SYM_FIELD_SIZE) {
+        res->size = linkStat.st_size;
+        sprintf(eos(out), "Symbolic link size: %ld\n", res->size);
     }
-    if (aFlag) {
-        res->access = dirStat.st_mode & 0777;
+    if (mask & SYM_FIELD_PERMS) {
+        res->access = linkStat.st_mode & 0777;
+        sprintf(eos(out), "Permissions:\n%s", print_permissions(res->access));
+    }
+    if (mask & SYM_FIELD_TARGET_SIZE) {
+        res->target_size = calculate_symlink_target_size((char *)path);
+        sprintf(eos(out), "Symbolic link target size: %ld\n", res->target_size);
+    }
+}
+#define SYM_HANDLER(mask) \
+    static void sym_handler_##mask(const char *path, SymbolicResult *res, char *out) { \
+        fill_sym_fields(path, mask, res, out); \
     }
-    if (tFlag) {
-        res->target_size = calculate_symlink_target_size(dirPath);
+#define SYM_HANDLER_ENTRY(mask) sym_handler_##mask,
+GEN_MASKS4(SYM_HANDLER)
+static void (*const sym_handlers[])(const char *, SymbolicResult *, char *) = { GEN_MASKS4(SYM_HANDLER_ENTRY) };
+_Static_assert(sizeof(sym_handlers) / sizeof(*sym_handlers) == SYM_HANDLER_COUNT, "one handler per SYM_FIELDS mask");
+// Get Symbolic link information into res and append the selected report lines to out
+void getSymInfo(const SymbolicOptions *opts, SymbolicResult *res, char *out){
+    // Delete the link if requested, nothing else is reported then
+    if (opts->delete){
+        unlink(opts->path);
+        res->path = opts->path;
+        res->deleted = 1;
+        return;
     }
-    return *res;
+    // Pick the handler for the entered options
+    int mask = (opts->name ? SYM_FIELD_NAME : 0) | (opts->size == 0 ? SYM_FIELD_SIZE : 0)
+               | (opts->perms ? SYM_FIELD_PERMS : 0) | (opts->target_size ? SYM_FIELD_TARGET_SIZE : 0);
+    sym_handlers[mask](opts->path, res, out);
 }
 // Print Symbolic link information
 void PrintSymInfo(char *path, int *start, SymbolicOptions opts){
@@ -271,20 +901,12 @@ void PrintSymInfo(char *path, int *start, SymbolicOptions opts){
     while (!*start);
     SymbolicResult symres;
     char *result = (char *) malloc(1000 * sizeof(char));
-    symres = getSymInfo(opts);
     sprintf(result, "------------------------------------------\nDirectory Path:%s\n", path);
+    getSymInfo(&opts, &symres, result);
     if (opts.delete) {
         sprintf(eos(result), "Symbolic link deleted.\n");
         goto end;
     }
-    if (opts.name)
-        sprintf(eos(result), "Symbolic link Name: %s\n", symres.name);
-    if (opts.size >= 0)
-        sprintf(eos(result), "Symbolic link size: %ld\n", symres.size);
-    if (opts.perms)
-        sprintf(eos(result), "Permissions:\n%s", print_permissions(symres.access));
-    if (opts.target_size >= 0)
-        sprintf(eos(result), "Symbolic link target size: %ld\n", symres.target_size);
     int st;
     // Create a child process to change the link permissions
     pid_t p = fork();
@@ -303,12 +925,14 @@ void PrintSymInfo(char *path, int *start, SymbolicOptions opts){
 DirOptions GetDirectoryOptions(char *dirPath){
     // Open the directory
     DIR *dir = opendir(dirPath);
-    char options[5] = {'n', 'd', 'a', 'c', '\0'};
-    char input[10];
+    char options[8] = {'n', 'd', 'a', 'c', 'f', 'e', 'g', '\0'};
+    char input[32];
+    char rule[PATH_MAX];
     int invalidOption;
     // Initialize a flag for each option and save it to DirOptions structure
-    int nFlag = 0, dFlag = -1, aFlag = 0, cFlag = -1;
-    DirOptions opts = {strdup(dirPath), nFlag, dFlag, aFlag, cFlag};
+    int nFlag = 0, dFlag = -1, aFlag = 0, cFlag = -1, eFlag = -1, gFlag = 0;
+    DirFilter *filter = NULL;
+    DirOptions opts = {strdup(dirPath), nFlag, dFlag, aFlag, cFlag, NULL, 0, eFlag};
     if (dir == NULL) { // Exit if couldn't open the directory
         printf("Error: Failed to open directory %s\n", dirPath);
         exit(-1);
@@ -324,12 +948,15 @@ DirOptions GetDirectoryOptions(char *dirPath){
     printf("-d: Size of directory\n");
     printf("-a: Access rights\n");
     printf("-c: Total number of files with the .c extension\n");
+    printf("-f: Filter the traversal\n");
+    printf("-e: Estimate the size within a time budget\n");
+    printf("-g: Grade every .c file in the tree\n");
 
     // Get the user input and update the flags according to the entered options
     do {
         invalidOption = 0;
-        printf("Enter options (-[n/d/a/c]): ");
-        scanf("%s", input);
+        printf("Enter options (-[n/d/a/c/f/e/g]): ");
+        scanf("%31s", input);
         if (input[0] != '-') {
             invalidOption = 1;
         } else {
@@ -351,6 +978,41 @@ DirOptions GetDirectoryOptions(char *dirPath){
                         case 'c':
                             cFlag = 0;
                             break;
+                        case 'g':
+                            gFlag = 1;
+                            break;
+                        case 'e':
+                            while (eFlag < 0) { // Get the time budget in case of e option is entered
+                                printf("Enter time budget in milliseconds: ");
+                                if (scanf("%d", &eFlag) != 1) {
+                                    scanf("%*s");
+                                    eFlag = -1;
+                                }
+                            }
+                            break;
+                        case 'f':
+                            if (filter) {
+                                break;
+                            }
+                            // Get the filter rules in case of f option is entered, they are compiled once here
+                            filter = (DirFilter *) calloc(1, sizeof(DirFilter));
+                            filter->max_depth = -1;
+                            filter->min_size = -1;
+                            filter->max_size = -1;
+                            printf("Filter rules:\n");
+                            printf("x:<glob> exclude names, i:<glob> include file names\n");
+                            printf("X:<regex> exclude paths, I:<regex> include file paths\n");
+                            printf("depth:<n>, min:<bytes>, max:<bytes>, newer:<days>, older:<days>\n");
+                            while (1) {
+                                printf("Enter filter rule ('.' to finish): ");
+                                if (scanf("%4095s", rule) != 1 || strcmp(rule, ".") == 0) {
+                                    break;
+                                }
+                                if (add_filter_rule(filter, rule) != 0) {
+                                    printf("Error: Invalid filter rule\n");
+                                }
+                            }
+                            break;
                     }
                 }
             }
@@ -364,54 +1026,102 @@ DirOptions GetDirectoryOptions(char *dirPath){
     // Update the DirOptions structure with the updated flags and return it.
     opts.path = strdup(dirPath);
     opts.c_files = cFlag;
+    opts.filter = filter;
+    opts.estimate_ms = eFlag;
+    opts.grade = gFlag;
     opts.size = dFlag;
     opts.perms = aFlag;
     opts.name = nFlag;
     return opts;
 }
-// Get directory information and return a DirResult structure
-DirResult getDirInfo(DirOptions opts){
+// Fill a directory record with the fields in mask, the directory is only stat'ed when a field needs it
+// Always inlined with a constant mask by the handlers below.
+static inline __attribute__((always_inline)) void fill_dir_fields(const char *path, int mask, DirResult *res) {
+    struct stat dirStat;
+    res->path = path;
+    if (mask & DIR_STAT_FIELDS) {
+        throttle_stats(1);
+        stat(path, &dirStat);
+    }
+    if (mask & DIR_FIELD_NAME) {
+        res->name = path;
+    }
+    if (mask & DIR_FIELD_PERMS) {
+        res->access = dirStat.st_mode & 0777;
+    }
+}
+#define DIR_HANDLER(mask) \
+    static void dir_handler_##mask(const char *path, DirResult *res) { fill_dir_fields(path, mask, res); }
+#define DIR_HANDLER_ENTRY(mask) dir_handler_##mask,
+GEN_MASKS2(DIR_HANDLER)
+static void (*const dir_handlers[])(const char *, DirResult *) = { GEN_MASKS2(DIR_HANDLER_ENTRY) };
+_Static_assert(sizeof(dir_handlers) / sizeof(*dir_handlers) == DIR_HANDLER_COUNT, "one handler per DIR_FIELDS mask");
+// Get directory information into res
+// The name and permissions come from the handler for the entered options, the walks are done here.
+void getDirInfo(const DirOptions *opts, DirResult *res){
     // directory entry
     struct dirent *entry;
-    struct stat dirStat;
-    int cFlag = opts.c_files;
-    int aFlag = opts.perms;
-    int dFlag = opts.size;
-    int nFlag = opts.name;
-    char *dirPath = strdup(opts.path);
-    DIR *dir = opendir(dirPath);
-    stat(dirPath, &dirStat);
-    DirResult *res = (DirResult *) malloc(sizeof(struct dirResult));
-    res->path = strdup(dirPath);
-    // Get the required directory info according to the saved options and return a DirResult structure
-    if (nFlag) {
-        res->name = strdup(opts.path);
-    }
-    if (dFlag == 0) {
-        res->size = calculate_directory_size(dirPath);
+    int cFlag = opts->c_files;
+    const char *dirPath = opts->path;
+    dir_handlers[(opts->name ? DIR_FIELD_NAME : 0) | (opts->perms ? DIR_FIELD_PERMS : 0)](dirPath, res);
+    if (opts->size == 0) {
+        res->size = calculate_directory_size((char *)dirPath, opts->filter, opts->one_filesystem);
     } else {
         res->size = -1;
     }
-    if (aFlag) {
-        res->access = dirStat.st_mode & 0777;
+    if (opts->estimate_ms >= 0) {
+        res->estimate = estimate_directory_size(dirPath, opts->filter, opts->one_filesystem, opts->estimate_ms);
+    }
+    if (opts->grade) {
+        res->grades = grade_directory(dirPath, opts->filter, opts->one_filesystem, &res->grade_report);
+    }
+    const CheckpointRecord *done = NULL;
+    char *signature = NULL;
+    if (cFlag == 0 && checkpoint) {
+        // Skip the count if an earlier run already finished it
+        signature = walk_signature(opts->filter, 0);
+        done = checkpoint_find('C', dirPath, signature);
     }
-    if (cFlag == 0) {
+    if (done) {
+        cFlag = done->value;
+    } else if (cFlag == 0) {
+        DIR *dir = opendir(dirPath);
+        char entryPath[PATH_MAX];
+        struct stat entryStat;
+        int needStat = opts->filter && (opts->filter->min_size >= 0 || opts->filter->max_size >= 0
+                                       || opts->filter->newer_than || opts->filter->older_than);
         while ((entry = readdir(dir)) != NULL) { // Loop  through files and check its extension
 
             if (entry->d_type == DT_REG && strstr(entry->d_name, ".c") != NULL) {
+                if (opts->filter) {
+                    // Only stat the entry when a size or time rule needs it
+                    snprintf(entryPath, sizeof(entryPath), "%s/%s", dirPath, entry->d_name);
+                    if (needStat) {
+                        throttle_stats(1);
+                    }
+                    if (needStat && fstatat(dirfd(dir), entry->d_name, &entryStat, AT_SYMLINK_NOFOLLOW) != 0) {
+                        continue;
+                    }
+                    if (opts->filter->max_depth == 0
+                        || !filter_match_file(opts->filter, entry->d_name, entryPath, needStat ? &entryStat : NULL)) {
+                        continue;
+                    }
+                }
                 cFlag++;
             }
         }
+        closedir(dir);
+        if (checkpoint) {
+            checkpoint_append("C\t%s\t%s\t%d\n", dirPath, signature, cFlag);
+        }
     } else {
         res->c_files = -1;
     }
+    free(signature);
 
     if (cFlag >= 0) {
         res->c_files = cFlag;
     }
-    // Close the directory and return DirResult
-    closedir(dir);
-    return *res;
 }
 // Print directory information
 void PrintDirInfo(char *path, int *start, DirOptions opts) {
@@ -419,8 +1129,8 @@ void PrintDirInfo(char *path, int *start, DirOptions opts) {
     while (!*start);
     DirResult dirres;
     char *result = (char *) malloc(1000 * sizeof(char));
-    char *dirpath = (char *) malloc(sizeof(char));
-    dirres = getDirInfo(opts);
+    char *dirpath = (char *) malloc(PATH_MAX * sizeof(char));
+    getDirInfo(&opts, &dirres);
     sprintf(result, "------------------------------------------\nDirectory Path:%s\n", path);
     if (opts.name)
         sprintf(eos(result), "Directory Name: %s\n", get_folder_name(dirres.name));
@@ -430,7 +1140,33 @@ void PrintDirInfo(char *path, int *start, DirOptions opts) {
         sprintf(eos(result), "Permissions:\n%s", print_permissions(dirres.access));
     if (opts.c_files >= 0)
         sprintf(eos(result), "Total Number of c File: %d\n", dirres.c_files);
-    sprintf(dirpath, "%s/%s_file.txt", path, get_folder_name(dirres.path));
+    if (opts.estimate_ms >= 0) {
+        sprintf(eos(result), "Estimated total size: %.0f (+/- %.0f)\n", dirres.estimate.size, dirres.estimate.size_error);
+        sprintf(eos(result), "Estimated file count: %.0f (+/- %.0f)\n", dirres.estimate.files, dirres.estimate.files_error);
+        sprintf(eos(result), "Estimate samples: %d%s\n", dirres.estimate.samples, dirres.estimate.exact ? " (exact)"
+                : dirres.estimate.samples > 1 ? " (95% confidence)" : " (too few for an interval)");
+    }
+    if (opts.grade) {
+        // The summary of every directory goes to <dir>_grades.txt next to <dir>_file.txt
+        sprintf(eos(result), "Graded c files: %d\n", dirres.grades.count);
+        if (dirres.grades.count > 0) {
+            sprintf(eos(result), "Mean score: %lf\nMin score: %lf\nMax score: %lf\n", dirres.grades.sum / dirres.grades.count,
+                    dirres.grades.min, dirres.grades.max);
+        }
+        if (dirres.grades.limited > 0) {
+            sprintf(eos(result), "Resource limit exceeded: %d\n", dirres.grades.limited);
+        }
+        snprintf(dirpath, PATH_MAX, "%s/%s_grades.txt", path, get_folder_name(dirres.path));
+        FILE *report = fopen(dirpath, "w");
+        if (report) {
+            fputs(dirres.grade_report, report);
+            fclose(report);
+        } else {
+            sprintf(eos(result), "Error writing %s\n", dirpath);
+        }
+        free(dirres.grade_report);
+    }
+    snprintf(dirpath, PATH_MAX, "%s/%s_file.txt", path, get_folder_name(dirres.path));
     // Create a child process to create a new file
     int st;
     pid_t p = fork();
@@ -447,18 +1183,14 @@ void PrintDirInfo(char *path, int *start, DirOptions opts) {
 }
 // Get options for regular file and return a FileOptions structure
 FileOptions GetFileOptions(char *dirPath){
-    char options[7] = {'n', 'd', 'a', 'h', 'm', 'l', '\0'};
-    char input[10];
+    char options[11] = {'n', 'd', 'a', 'h', 'm', 'l', 'w', 'c', 'L', 'u', '\0'};
+    char input[32];
     int invalidOption;
     char symlinkname[20] = {'\0'};
     // Initialize a flag for each option and save it to FileOptions structure
     int nFlag = 0, dFlag = -1, aFlag = 0, hFlag = -1, lFlag = 0, mFlag = 0;
+    int wFlag = 0, cFlag = 0, LFlag = 0, uFlag = 0;
     FileOptions opts = {strdup(dirPath), nFlag, dFlag, hFlag, mFlag, aFlag, lFlag, strdup("")};
-    struct stat filestat;
-    if (stat(dirPath, &filestat) != 0) {
-        perror("stat");
-        exit(0);
-    }
 
     // Print directory name and message
     printf("File: %s\n", dirPath);
@@ -472,12 +1204,16 @@ FileOptions GetFileOptions(char *dirPath){
     printf("-m: Last modification time\n");
     printf("-l: Create a symbolic link\n");
     printf("-h: Hard link count\n");
+    printf("-w: Word count\n");
+    printf("-c: Byte count\n");
+    printf("-L: Longest line length\n");
+    printf("-u: Check for non UTF-8 bytes\n");
 
     // Get the user input and update the flags according to the entered options
     do {
         invalidOption = 0;
-        printf("Enter options (-[n/d/a/m/l/h]): ");
-        scanf("%s", input);
+        printf("Enter options (-[n/d/a/m/l/h/w/c/L/u]): ");
+        scanf("%31s", input);
         if (input[0] != '-') {
             invalidOption = 1;
         } else {
@@ -502,6 +1238,18 @@ FileOptions GetFileOptions(char *dirPath){
                         case 'h':
                             hFlag = 0;
                             break;
+                        case 'w':
+                            wFlag = 1;
+                            break;
+                        case 'c':
+                            cFlag = 1;
+                            break;
+                        case 'L':
+                            LFlag = 1;
+                            break;
+                        case 'u':
+                            uFlag = 1;
+                            break;
                         case 'l':
                             lFlag = 1;
                             while (!strlen(symlinkname)) { // Get sym link name in case of l option is entered
@@ -528,46 +1276,66 @@ FileOptions GetFileOptions(char *dirPath){
     opts.size = dFlag;
     opts.perms = aFlag;
     opts.name = nFlag;
+    opts.words = wFlag;
+    opts.bytes = cFlag;
+    opts.longest_line = LFlag;
+    opts.utf8 = uFlag;
     return opts;
 }
-// Get file information and return a FileResult structure
-FileResult getFileInfo(FileOptions opts){
-    struct stat dirStat;
-    int nFlag = opts.name;
-    int aFlag = opts.perms;
-    int dFlag = opts.size;
-    int hFlag = opts.hard_link;
-    int lFlag = opts.symbolic;
-    int mFlag = opts.last_modification;
-    char *dirPath = strdup(opts.path);
-    lstat(dirPath, &dirStat);
-    FileResult *res = (FileResult *) malloc(sizeof(struct fileresult));
-    res->path = strdup(dirPath);
-    // Get the required file info according to the saved options and return a FileResult structure
-    if (lFlag){
-        symlink(dirPath, opts.symbolic_name);
-        res->symbolic = 1;
+// Fill a file record with the fields in mask and append their report lines to out, the file is only
+// stat'ed when a field needs it. Always inlined with a constant mask by the handlers below.
+static inline __attribute__((always_inline)) void fill_file_fields(const char *path, int mask, FileResult *res,
+                                                                   char *out) {
+    struct stat fileStat;
+    res->path = path;
+    res->size = -1;
+    res->hard_link = -1;
+    if (mask & FILE_STAT_FIELDS) {
+        throttle_stats(1);
+        lstat(path, &fileStat);
     }
-    if (nFlag) {
-        res->name = strdup(get_folder_name(dirPath));
+    if (mask & FILE_FIELD_NAME) {
+        res->name = get_folder_name(path);
+        sprintf(eos(out), "File Name: %s\n", res->name);
     }
-    if (dFlag == 0) {
-        res->size = dirStat.st_size;
-    } else {
-        res->size = -1;
+    if (mask & FILE_FIELD_SIZE) {
+        res->size = fileStat.st_size;
+        sprintf(eos(out), "File size: %ld\n", res->size);
     }
-    if (aFlag) {
-        res->access = dirStat.st_mode & 0777;
+    if (mask & FILE_FIELD_PERMS) {
+        res->access = fileStat.st_mode & 0777;
+        sprintf(eos(out), "Permissions:\n%s", print_permissions(res->access));
     }
-    if (hFlag == 0) {
-        res->hard_link = dirStat.st_nlink;
-    } else {
-        res->hard_link = -1;
+    if (mask & FILE_FIELD_HARD_LINK) {
+        res->hard_link = fileStat.st_nlink;
+        sprintf(eos(out), "Hard link count: %d\n", res->hard_link);
     }
-    if (mFlag){
-        res->mtime = dirStat.st_mtime;
+    if (mask & FILE_FIELD_MTIME) {
+        res->mtime = fileStat.st_mtime;
+        sprintf(eos(out), "Last modification time: %s\n", ctime(&res->mtime));
     }
-    return *res;
+}
+#define FILE_HANDLER(mask) \
+    static void file_handler_##mask(const char *path, FileResult *res, char *out) { \
+        fill_file_fields(path, mask, res, out); \
+    }
+#define FILE_HANDLER_ENTRY(mask) file_handler_##mask,
+GEN_MASKS5(FILE_HANDLER)
+static void (*const file_handlers[])(const char *, FileResult *, char *) = { GEN_MASKS5(FILE_HANDLER_ENTRY) };
+_Static_assert(sizeof(file_handlers) / sizeof(*file_handlers) == FILE_HANDLER_COUNT, "one handler per FILE_FIELDS mask");
+// Get file information into res
+void getFileInfo(const FileOptions *opts, FileResult *res, char *out){
+    // Create the symbolic link if requested
+    res->symbolic = 0;
+    if (opts->symbolic){
+        symlink(opts->path, opts->symbolic_name);
+        res->symbolic = 1;
+    }
+    // Pick the handler for the entered options
+    int mask = (opts->name ? FILE_FIELD_NAME : 0) | (opts->size == 0 ? FILE_FIELD_SIZE : 0)
+               | (opts->perms ? FILE_FIELD_PERMS : 0) | (opts->hard_link == 0 ? FILE_FIELD_HARD_LINK : 0)
+               | (opts->last_modification ? FILE_FIELD_MTIME : 0);
+    file_handlers[mask](opts->path, res, out);
 }
 // Print file information
 void PrintFileInfo(char *path, int *start, FileOptions opts){
@@ -575,32 +1343,49 @@ void PrintFileInfo(char *path, int *start, FileOptions opts){
     while (!*start);
     FileResult symres;
     char *result = (char *) malloc(1000 * sizeof(char));
-    symres = getFileInfo(opts);
     sprintf(result, "------------------------------------------\nDirectory Path:%s\n", path);
-    if (opts.name)
-        sprintf(eos(result), "File Name: %s\n", symres.name);
-    if (opts.size >= 0)
-        sprintf(eos(result), "File size: %ld\n", symres.size);
-    if (opts.perms)
-        sprintf(eos(result), "Permissions:\n%s", print_permissions(symres.access));
-    if (opts.hard_link >= 0)
-        sprintf(eos(result), "Hard link count: %d\n", symres.hard_link);
-    if (opts.last_modification) {
-        sprintf(eos(result), "Last modification time: %s\n", ctime(&symres.mtime));
-    }
+    getFileInfo(&opts, &symres, result);
     if (opts.symbolic) {
         sprintf(eos(result), "Symbolic link created: %s\n", opts.symbolic_name);
     }
     // Check file extension
     if (check_file_extension(path, ".c")) { // If c file, compile_file_in_child function will be called to compile the file in child process
-        double score = compile_file_in_child((char *)symres.path);
-        sprintf(eos(result), "Score: %lf\n", score);
-        // Append the score to grades.txt file
+        // A file graded by an earlier run is already in grades.txt
+        const CheckpointRecord *done = checkpoint ? checkpoint_find('G', symres.path, NULL) : NULL;
+        double score = done ? done->score : opts.graded ? opts.score : compile_file_in_child((char *)symres.path, NULL);
         char filecontent[100];
-        sprintf(filecontent, "%s:%lf\n", get_folder_name(symres.path), score);
-        create_file("grades.txt", filecontent);
-    } else { // If a regular file, the line count will be printed
-        sprintf(eos(result), "Line Count: %d\n", count_lines_in_file(symres.path));
+        if (score < 0) {
+            // The compile was stopped by a resource limit
+            sprintf(eos(result), "Score: resource limit exceeded (%s)\n", score_limit_name(score));
+            snprintf(filecontent, sizeof(filecontent), "%s:limit exceeded (%s)\n",
+                     get_folder_name(symres.path), score_limit_name(score));
+        } else {
+            sprintf(eos(result), "Score: %lf\n", score);
+            snprintf(filecontent, sizeof(filecontent), "%s:%lf\n", get_folder_name(symres.path), score);
+        }
+        if (!done) {
+            // Append the score to grades.txt file
+            create_file("grades.txt", filecontent);
+            if (checkpoint) {
+                checkpoint_append("G\t%s\t%.17g\n", symres.path, score);
+            }
+        }
+    } else { // If a regular file, the line count and the selected text statistics will be printed
+        TextStats stats;
+        int selection = (opts.words ? TEXT_WORDS : 0) | (opts.longest_line ? TEXT_LONGEST_LINE : 0) | (opts.utf8 ? TEXT_UTF8 : 0);
+        if (count_text_stats(symres.path, selection, &stats) != 0) {
+            printf("Error opening file\n");
+            stats.lines = -1;
+        }
+        sprintf(eos(result), "Line Count: %lld\n", stats.lines);
+        if (opts.words)
+            sprintf(eos(result), "Word Count: %lld\n", stats.words);
+        if (opts.bytes)
+            sprintf(eos(result), "Byte Count: %lld\n", stats.bytes);
+        if (opts.longest_line)
+            sprintf(eos(result), "Longest Line: %lld\n", stats.longest_line);
+        if (opts.utf8)
+            sprintf(eos(result), "Valid UTF-8: %s\n", stats.non_utf8 ? "no" : "yes");
     }
     sprintf(eos(result), "%s", "------------------------------------------\n");
     printf("%s",result);
@@ -628,17 +1413,41 @@ char* print_permissions(int permissions) {
     sprintf(eos(perms), "\tExec - %s\n", (permissions & 01) ? "yes" : "no");
     return perms;
 }
-// Calculates the actual data size inside a directory
-off_t calculate_directory_size(char *path) {
+// Calculates the actual data size inside a directory. Filtered out subtrees are never opened.
+// With one_filesystem set, directories on other mounts are not entered.
+// When checkpointing, the progress is saved periodically and a resumed walk skips what was already added.
+off_t calculate_directory_size(char *path, const DirFilter *filter, int one_filesystem) {
     // The fts functions are provided for traversing file hierarchies
     FTS *fts;
     FTSENT *entry;
     off_t total_size = 0;
+    char *signature = NULL;
+    const char *frontier = NULL;
+    time_t last_save = time(NULL);
+    size_t root_len = strlen(path);
+
+    if (checkpoint) {
+        signature = walk_signature(filter, one_filesystem);
+        const CheckpointRecord *done = checkpoint_find('S', path, signature);
+        if (done) {
+            free(signature);
+            return done->value;
+        }
+        // Continue after the last saved directory
+        const CheckpointRecord *progress = checkpoint_find('P', path, signature);
+        if (progress) {
+            total_size = progress->value;
+            frontier = progress->frontier;
+        }
+    }
 
     char *path_argv[] = {path, NULL};
     int fts_options = FTS_PHYSICAL | FTS_NOCHDIR;
-    // Open the directory
-    fts = fts_open(path_argv, fts_options, NULL);
+    if (one_filesystem) {
+        fts_options |= FTS_XDEV;
+    }
+    // Open the directory, the walk order must be the same in every run to resume it
+    fts = fts_open(path_argv, fts_options, checkpoint ? compare_fts_names : NULL);
 
     if (!fts) {
         perror("fts_open");
@@ -646,12 +1455,41 @@ off_t calculate_directory_size(char *path) {
     }
     // Loop through all files and add its size to total_size variable
     while ((entry = fts_read(fts)) != NULL) {
-        if (entry->fts_info == FTS_F) {
+        throttle_stats(1);
+        if (frontier && entry->fts_level > 0 && entry->fts_info != FTS_DP) {
+            int position = walk_position(entry->fts_path, frontier, root_len);
+            if (position == WALK_AFTER) {
+                // Everything from here on is new
+                frontier = NULL;
+            } else if (position != WALK_ANCESTOR) {
+                // Already added by the earlier run
+                if (entry->fts_info == FTS_D) {
+                    fts_set(fts, entry, FTS_SKIP);
+                }
+                continue;
+            }
+        }
+        if (checkpoint && entry->fts_info == FTS_DP && time(NULL) - last_save >= checkpoint->interval) {
+            // Everything up to the end of this directory is in total_size
+            checkpoint_append("P\t%s\t%s\t%lld\t%s\n", path, signature, (long long) total_size, entry->fts_path);
+            last_save = time(NULL);
+        }
+        if (filter && entry->fts_info == FTS_D
+            && filter_skip_dir(filter, entry->fts_name, entry->fts_path, entry->fts_level)) {
+            fts_set(fts, entry, FTS_SKIP);
+            continue;
+        }
+        if (entry->fts_info == FTS_F
+            && (!filter || filter_match_file(filter, entry->fts_name, entry->fts_path, entry->fts_statp))) {
             total_size += entry->fts_statp->st_size;
         }
     }
     // Close the directory and return total size
     fts_close(fts);
+    if (checkpoint) {
+        checkpoint_append("S\t%s\t%s\t%lld\n", path, signature, (long long) total_size);
+        free(signature);
+    }
 
     return total_size;
 }
@@ -734,19 +1572,18 @@ int set_file_permissions(const char* filename, int permissions) {
     }
 }
 
-// Checks the file type using lstat
-enum FileType getFileType(const char *path) {
-    struct stat st;
-    if (lstat(path, &st) == -1) {
+// Checks the file type using lstat, the lstat data is left in st
+enum FileType getFileType(const char *path, struct stat *st) {
+    if (lstat(path, st) == -1) {
         fprintf(stderr, "Error: failed to stat file %s\n", path);
         exit(EXIT_FAILURE);
     }
 	//check file type
-    if (S_ISREG(st.st_mode)) {
+    if (S_ISREG(st->st_mode)) {
         return FILE_TYPE_FILE;
-    } else if (S_ISDIR(st.st_mode)) {
+    } else if (S_ISDIR(st->st_mode)) {
         return FILE_TYPE_DIRECTORY;
-    } else if (S_ISLNK(st.st_mode)) {
+    } else if (S_ISLNK(st->st_mode)) {
         return FILE_TYPE_SYMBOLIC_LINK;
     } else {
         return FILE_TYPE_UNKNOWN;
@@ -763,24 +1600,160 @@ int check_file_extension(const char *path, const char *extension) {
         return 0;
     }
 }
-// Opens a file and count its lines
-int count_lines_in_file(const char *filename) {
-    // Open the file or return in case of error
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        printf("Error opening file\n");
-        return -1;
+// Check if a byte is white space for word counting, same set as isspace in the C locale
+static inline int is_text_space(unsigned char c) {
+    return c == ' ' || (unsigned char)(c - '\t') < 5;
+}
+// Mark the white space lanes of a byte vector
+static inline ByteMask text_space_mask(ByteVector v) {
+    return (v == ' ') | ((ByteVector)(v - '\t') < 5);
+}
+// Advance the UTF-8 check by one byte, returns 0 when the byte can't appear here
+static inline int utf8_step(TextScanState *state, unsigned char c) {
+    if (state->utf8_need) {
+        if (c < state->utf8_low || c > state->utf8_high) {
+            return 0;
+        }
+        state->utf8_need--;
+        state->utf8_low = 0x80;
+        state->utf8_high = 0xBF;
+        return 1;
+    }
+    if (c < 0x80) {
+        return 1;
+    }
+    // Lead byte, the ranges rule out overlong forms, surrogates and code points past U+10FFFF
+    state->utf8_low = 0x80;
+    state->utf8_high = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) {
+        state->utf8_need = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        state->utf8_need = 2;
+        if (c == 0xE0) state->utf8_low = 0xA0;
+        if (c == 0xED) state->utf8_high = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        state->utf8_need = 3;
+        if (c == 0xF0) state->utf8_low = 0x90;
+        if (c == 0xF4) state->utf8_high = 0x8F;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+// Scan one block for the selected counters
+// It is always inlined with a constant selection, so each scanner below only has the loops it needs.
+static inline __attribute__((always_inline)) void scan_text_block(const unsigned char *block, size_t len, int selection,
+                                                                  TextScanState *state, TextStats *stats) {
+    const unsigned char *end = block + len;
+    stats->bytes += len;
+
+    // Lines and their lengths come from the newline positions
+    const unsigned char *line = block, *newline;
+    while ((newline = memchr(line, '\n', end - line)) != NULL) {
+        stats->lines++;
+        if (selection & TEXT_LONGEST_LINE) {
+            long long length = state->line_length + (newline - line);
+            if (length > stats->longest_line) {
+                stats->longest_line = length;
+            }
+            state->line_length = 0;
+        }
+        line = newline + 1;
     }
-    int line_count = 0;
-    int ch = 0;
-    // get a char till the end of the file and check if the char equals to '\n'
-    while ((ch = fgetc(file)) != EOF) {
-        if (ch == '\n') {
-            line_count++;
+    if (selection & TEXT_LONGEST_LINE) {
+        state->line_length += end - line;
+    }
+
+    // A word starts at a non space byte that follows a space byte, 16 bytes are compared at a time
+    if ((selection & TEXT_WORDS) && len > 0) {
+        if (!is_text_space(block[0]) && !state->in_word) {
+            stats->words++;
+        }
+        size_t i = 1;
+        while (i + 16 <= len) {
+            // Lane counters are bytes, so they are added up at least every 255 rounds
+            ByteVector counts = {0};
+            for (int round = 0; round < 255 && i + 16 <= len; round++, i += 16) {
+                ByteVector current, previous;
+                memcpy(&current, block + i, 16);
+                memcpy(&previous, block + i - 1, 16);
+                counts -= (ByteVector)(~text_space_mask(current) & text_space_mask(previous));
+            }
+            for (int lane = 0; lane < 16; lane++) {
+                stats->words += counts[lane];
+            }
+        }
+        for (; i < len; i++) {
+            if (!is_text_space(block[i]) && is_text_space(block[i - 1])) {
+                stats->words++;
+            }
+        }
+        state->in_word = !is_text_space(block[len - 1]);
+    }
+
+    // Runs of ASCII are skipped 8 bytes at a time, other bytes go through the UTF-8 check
+    if ((selection & TEXT_UTF8) && !stats->non_utf8) {
+        size_t i = 0;
+        while (i < len) {
+            if (!state->utf8_need && i + 8 <= len) {
+                unsigned long long word;
+                memcpy(&word, block + i, 8);
+                if (!(word & 0x8080808080808080ULL)) {
+                    i += 8;
+                    continue;
+                }
+            }
+            if (!utf8_step(state, block[i])) {
+                stats->non_utf8 = 1;
+                break;
+            }
+            i++;
         }
     }
-    fclose(file);
-    return line_count;
+}
+// One scanner per selection of counters
+#define TEXT_SCANNER(selection) \
+    static void scan_text_##selection(const unsigned char *block, size_t len, TextScanState *state, TextStats *stats) { \
+        scan_text_block(block, len, selection, state, stats); \
+    }
+TEXT_SCANNER(0)
+TEXT_SCANNER(1)
+TEXT_SCANNER(2)
+TEXT_SCANNER(3)
+TEXT_SCANNER(4)
+TEXT_SCANNER(5)
+TEXT_SCANNER(6)
+TEXT_SCANNER(7)
+static void (*const text_scanners[TEXT_SELECTIONS])(const unsigned char *, size_t, TextScanState *, TextStats *) = {
+    scan_text_0, scan_text_1, scan_text_2, scan_text_3, scan_text_4, scan_text_5, scan_text_6, scan_text_7
+};
+// Read a file once and compute its line and byte counts plus the selected TEXT_ counters
+// Returns -1 when the file can't be read.
+int count_text_stats(const char *filename, int selection, TextStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    void (*scan)(const unsigned char *, size_t, TextScanState *, TextStats *) = text_scanners[selection & (TEXT_SELECTIONS - 1)];
+    TextScanState state = {0};
+    unsigned char *buffer = take_scan_buffer(READ_BLOCK_SIZE);
+    ssize_t len;
+    while ((len = read(fd, buffer, READ_BLOCK_SIZE)) > 0) {
+        throttle_bytes(len);
+        scan(buffer, len, &state, stats);
+    }
+    // The last line may have no newline, and the file must not end inside a UTF-8 sequence
+    if ((selection & TEXT_LONGEST_LINE) && state.line_length > stats->longest_line) {
+        stats->longest_line = state.line_length;
+    }
+    if ((selection & TEXT_UTF8) && state.utf8_need) {
+        stats->non_utf8 = 1;
+    }
+    give_scan_buffer(buffer);
+    close(fd);
+    return len < 0 ? -1 : 0;
 }
 // Calculate the score according to the given formula
 double calculateScore(int errors, int warnings) {
@@ -797,7 +1770,13 @@ double calculateScore(int errors, int warnings) {
     return score;
 }
 // Function to compile c file in child process
-double compile_file_in_child(char *argv){
+// Options may be NULL, otherwise they add an include directory or set the output file.
+// gcc runs under grade_limits, a compile stopped by a limit returns one of the SCORE_LIMIT values.
+double compile_file_in_child(char *argv, const CompileOptions *options){
+    // Put the compile in its own cgroup when the cgroup tree is writable, rlimits are used anyway
+    char cgroup[PATH_MAX];
+    int has_cgroup = create_grade_cgroup(cgroup, sizeof(cgroup));
+
     // Create pipes and exit in case of error
     int pipe1[2], pipe2[2];
     if(pipe(pipe1) < 0)
@@ -843,12 +1822,41 @@ double compile_file_in_child(char *argv){
 
         dup2(pipe1[1], 2);
 
-        execlp("gcc", "gcc", "-Wall", "-o", "prog", argv, NULL);
+        // Own process group so a timed out compile can be killed with everything it started
+        setpgid(0, 0);
+        if(has_cgroup)
+        {
+            char procs[PATH_MAX + 16];
+            snprintf(procs, sizeof(procs), "%s/cgroup.procs", cgroup);
+            write_text_file(procs, "0");
+        }
+        apply_grade_rlimits();
+
+        if(options == NULL)
+            execlp("gcc", "gcc", "-Wall", "-o", "prog", argv, NULL);
+
+        char *args[8];
+        int n = 0;
+        args[n++] = "gcc";
+        args[n++] = "-Wall";
+        if(options->include_dir)
+        {
+            args[n++] = "-I";
+            args[n++] = (char *)options->include_dir;
+        }
+        args[n++] = "-o";
+        args[n++] = options->output ? (char *)options->output : "prog";
+        args[n++] = argv;
+        args[n] = NULL;
+        execvp("gcc", args);
 
 
         exit(-1);
     }
 
+    // Also set from here, so the group exists before a timeout kill is sent to it
+    setpgid(pid1, pid1);
+
     if((pid2=fork())<0)
     {
         perror("Error\n");
@@ -874,7 +1882,8 @@ double compile_file_in_child(char *argv){
 
         dup2(pipe2[1], 1);
 
-        execlp("grep", "grep", "(error|warning)", "-E", NULL);
+        // cc1 reports running out of address space without the word error
+        execlp("grep", "grep", "(error|warning|out of memory allocating|virtual memory exhausted)", "-E", NULL);
 
         exit(-2);
     }
@@ -902,21 +1911,55 @@ double compile_file_in_child(char *argv){
     int war=0;
 
     int rparent;
-    char ch;
+    char chunk[4096];
     char text_buffer[40960]="";
     int len=0;
+    int timed_out=0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long deadline = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + grade_limits.wall_seconds * 1000;
+    struct pollfd pfd = {pipe2[0], POLLIN, 0};
 
-    while((rparent=read(pipe2[0], &ch, sizeof(char))) != 0)
+    while(1)
     {
+        // Wait for output until the wall clock limit, then kill the whole compile
+        int wait_ms = -1;
+        if(grade_limits.wall_seconds > 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            long long left = deadline - (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+            wait_ms = left > 0 ? (int)left : 0;
+        }
+        int ready = poll(&pfd, 1, wait_ms);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready == 0 && !timed_out)
+        {
+            timed_out=1;
+            kill(-pid1, SIGKILL);
+            // Give grep one second to pass on what it already has, then stop reading
+            deadline += 1000;
+            continue;
+        }
+        if(ready == 0)
+            break;
+
+        rparent=read(pipe2[0], chunk, sizeof(chunk));
+        if(rparent == 0)
+            break;
         if (rparent < 0)
         {
             perror("Error\n");
             exit(13);
         }
 
-        text_buffer[len]=ch;
-        len++;
+        // Only the start of long output is kept for scoring, the rest is drained
+        if(len + rparent >= (int)sizeof(text_buffer))
+            rparent = sizeof(text_buffer) - 1 - len;
+        memcpy(text_buffer + len, chunk, rparent);
+        len += rparent;
     }
+    text_buffer[len]='\0';
 
     if(close(pipe2[0]) < 0)
     {
@@ -927,6 +1970,12 @@ double compile_file_in_child(char *argv){
     if(strstr(text_buffer, "error"))
         iserror=1;
 
+    // gcc names the signal that killed one of its programs, e.g. cc1 or ld
+    int limit_cpu = compile_tool_message(text_buffer, "gcc", "CPU time limit exceeded signal terminated program");
+    int limit_output = compile_tool_message(text_buffer, "gcc", "File size limit exceeded signal terminated program");
+    int limit_killed = compile_tool_message(text_buffer, "gcc", "Killed signal terminated program");
+    int limit_memory = compile_ran_out_of_memory(text_buffer);
+
     char sep[]=" \r\n,.!?";
 
     char *p;
@@ -943,15 +1992,17 @@ double compile_file_in_child(char *argv){
     double result = calculateScore(iserror, war);
 
     char buff[20480];
-    int status, wait_pid;
+    int status, wait_pid, gcc_status=0;
     int k;
     for(k=0;k<2;k++)
     {
-        if((wait_pid=wait(&status)) < 0)
+        if((wait_pid=waitpid(k == 0 ? pid1 : pid2, &status, 0)) < 0)
         {
             perror("Error\n");
             exit(15);
         }
+        if(wait_pid == pid1)
+            gcc_status=status;
 
         if(WIFEXITED(status))
             continue;
@@ -965,5 +2016,1928 @@ double compile_file_in_child(char *argv){
             }
         }
     }
+
+    int oom=0;
+    if(has_cgroup)
+    {
+        // The cgroup counts the processes it killed for memory
+        char events[PATH_MAX + 16], line[64];
+        snprintf(events, sizeof(events), "%s/memory.events", cgroup);
+        FILE *fp = fopen(events, "r");
+        long count;
+        while(fp && fgets(line, sizeof(line), fp))
+        {
+            if(sscanf(line, "oom_kill %ld", &count) == 1 && count > 0)
+                oom=1;
+        }
+        if(fp)
+            fclose(fp);
+        rmdir(cgroup);
+    }
+
+    // Tell a compile stopped by a limit from a graded one. The wait status and the cgroup are sure,
+    // the messages of gcc cover the programs it started itself.
+    int gcc_signal = WIFSIGNALED(gcc_status) ? WTERMSIG(gcc_status) : 0;
+    if(timed_out)
+        result = SCORE_LIMIT_TIME;
+    else if(gcc_signal == SIGXFSZ)
+        result = SCORE_LIMIT_OUTPUT;
+    else if(gcc_signal == SIGXCPU)
+        result = SCORE_LIMIT_CPU;
+    else if(oom || gcc_signal == SIGKILL)
+        result = SCORE_LIMIT_MEMORY;
+    else if(limit_output)
+        result = SCORE_LIMIT_OUTPUT;
+    else if(limit_cpu)
+        result = SCORE_LIMIT_CPU;
+    else if(limit_killed || limit_memory)
+        result = SCORE_LIMIT_MEMORY;
     return result;
 }
+// Mix a block of bytes into a content hash. Only the last block of a file may have a length that isn't a multiple of 8.
+void hash_update(ContentHash *h, const unsigned char *data, size_t len) {
+    unsigned long long w;
+    size_t i;
+    // Two independent lanes over 8-byte words
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, data + i, 8);
+        h->h1 = (h->h1 ^ w) * 0x9E3779B97F4A7C15ULL;
+        h->h1 = (h->h1 << 31) | (h->h1 >> 33);
+        h->h2 = (h->h2 + w) * 0xC2B2AE3D27D4EB4FULL;
+        h->h2 ^= h->h2 >> 29;
+    }
+    // Remaining tail bytes
+    for (; i < len; i++) {
+        h->h1 = (h->h1 ^ data[i]) * 0x100000001B3ULL;
+        h->h2 = (h->h2 + data[i]) * 0xFF51AFD7ED558CCDULL;
+    }
+}
+// Hash the first limit bytes of a file (whole file if limit is 0). Returns 0 on success.
+int hash_file(const char *path, off_t size, off_t limit, ContentHash *out) {
+    ContentHash h = {0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL};
+    off_t len = (limit > 0 && limit < size) ? limit : size;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    // Map the file and hash it in one pass, fall back to large reads
+    void *map = len > DUP_PARTIAL_BYTES ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (map != MAP_FAILED) {
+        madvise(map, len, MADV_SEQUENTIAL);
+        // Hash in blocks that are a multiple of 8 so the read budget is charged as we go
+        for (off_t done = 0; done < len; done += DUP_READ_BUFFER) {
+            off_t block = len - done < DUP_READ_BUFFER ? len - done : DUP_READ_BUFFER;
+            throttle_bytes(block);
+            hash_update(&h, (unsigned char *) map + done, block);
+        }
+        munmap(map, len);
+    } else {
+        unsigned char *buffer = take_scan_buffer(DUP_READ_BUFFER);
+        off_t done = 0;
+        while (done < len) {
+            // Fill the whole buffer so only the last block has a tail
+            size_t want = len - done < DUP_READ_BUFFER ? len - done : DUP_READ_BUFFER;
+            size_t got = 0;
+            ssize_t r = 1;
+            throttle_bytes(want);
+            while (got < want && (r = read(fd, buffer + got, want - got)) > 0) {
+                got += r;
+            }
+            if (r < 0) {
+                give_scan_buffer(buffer);
+                close(fd);
+                return -1;
+            }
+            if (got == 0) {
+                break;
+            }
+            hash_update(&h, buffer, got);
+            done += got;
+        }
+        give_scan_buffer(buffer);
+    }
+    close(fd);
+    h.h1 ^= (unsigned long long) len;
+    h.h2 ^= h.h1 >> 17;
+    *out = h;
+    return 0;
+}
+// Hash entry i of a HashJob, run by the worker pool
+void hash_job_entry(int i, int worker, void *arg) {
+    HashJob *job = (HashJob *) arg;
+    DupEntry *e = &job->entries[job->indexes[i]];
+    (void) worker;
+    // Each taken entry requests the one PREFETCH_DEPTH ahead, so reads for upcoming files stay queued
+    if (i + PREFETCH_DEPTH < job->count) {
+        prefetch_file(job->entries[job->indexes[i + PREFETCH_DEPTH]].file.path, job->limit);
+    }
+    if (hash_file(e->file.path, e->file.size, job->limit, &job->hashes[i]) != 0) {
+        // Unreadable files get a hash that can't match any other entry
+        job->hashes[i].h1 = (unsigned long long) e->dev;
+        job->hashes[i].h2 = ~(unsigned long long) e->ino;
+    }
+}
+// Hash the given entries in child processes. Results are written to shared memory and returned.
+ContentHash *hash_files_parallel(DupEntry *entries, int *indexes, int count, off_t limit) {
+    ContentHash *hashes = mmap(NULL, count * sizeof(ContentHash),
+                               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+    if (hashes == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    // The first entries are requested here, the workers keep the window moving
+    for (int i = 0; i < count && i < PREFETCH_DEPTH; i++) {
+        prefetch_file(entries[indexes[i]].file.path, limit);
+    }
+    HashJob job = {entries, indexes, count, limit, hashes};
+    parallel_for(count, hash_job_entry, &job);
+    return hashes;
+}
+// Compare duplicate entries by device and inode
+int compare_dup_inode(const void *a, const void *b) {
+    const DupEntry *x = a, *y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return 0;
+}
+// Compare duplicate entries by size
+int compare_dup_size(const void *a, const void *b) {
+    const DupEntry *x = a, *y = b;
+    if (x->file.size != y->file.size) {
+        return x->file.size < y->file.size ? -1 : 1;
+    }
+    return strcmp(x->file.path, y->file.path);
+}
+// Compare candidates by size and then by hash
+int compare_dup_candidate(const void *a, const void *b) {
+    const DupCandidate *x = a, *y = b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if (x->hash.h1 != y->hash.h1) {
+        return x->hash.h1 < y->hash.h1 ? -1 : 1;
+    }
+    if (x->hash.h2 != y->hash.h2) {
+        return x->hash.h2 < y->hash.h2 ? -1 : 1;
+    }
+    return x->index - y->index;
+}
+// Hash the candidates and keep only those sharing size and hash with another one.
+// The kept indexes are stored group after group with their group number in groups. Returns the new count.
+int filter_dup_candidates(DupEntry *entries, int *indexes, int *groups, int count, off_t limit) {
+    if (count == 0) {
+        return 0;
+    }
+    ContentHash *hashes = hash_files_parallel(entries, indexes, count, limit);
+    DupCandidate *cand = (DupCandidate *) malloc(count * sizeof(DupCandidate));
+    for (int i = 0; i < count; i++) {
+        cand[i].index = indexes[i];
+        cand[i].size = entries[indexes[i]].file.size;
+        cand[i].hash = hashes[i];
+    }
+    munmap(hashes, count * sizeof(ContentHash));
+    qsort(cand, count, sizeof(DupCandidate), compare_dup_candidate);
+    // Keep every run of equal size and hash with at least 2 entries
+    int kept = 0, group = 0;
+    for (int i = 0, j; i < count; i = j) {
+        for (j = i + 1; j < count && cand[j].size == cand[i].size
+                        && cand[j].hash.h1 == cand[i].hash.h1 && cand[j].hash.h2 == cand[i].hash.h2; j++);
+        if (j - i > 1) {
+            for (int k = i; k < j; k++) {
+                indexes[kept] = cand[k].index;
+                groups[kept++] = group;
+            }
+            group++;
+        }
+    }
+    free(cand);
+    return kept;
+}
+// Compare the contents of two files of the given size, returns 1 when they are equal
+int same_file_content(const char *a, const char *b, off_t size) {
+    struct stat sa, sb;
+    int same = 0;
+    int fa = open(a, O_RDONLY);
+    int fb = open(b, O_RDONLY);
+    // A file that changed size since the walk can't be mapped safely and doesn't match anyway
+    if (fa >= 0 && fb >= 0 && fstat(fa, &sa) == 0 && fstat(fb, &sb) == 0
+        && sa.st_size == size && sb.st_size == size) {
+        unsigned char *ma = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fa, 0);
+        unsigned char *mb = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fb, 0);
+        if (ma != MAP_FAILED && mb != MAP_FAILED) {
+            madvise(ma, size, MADV_SEQUENTIAL);
+            madvise(mb, size, MADV_SEQUENTIAL);
+            same = 1;
+            for (off_t done = 0; same && done < size; done += DUP_READ_BUFFER) {
+                off_t block = size - done < DUP_READ_BUFFER ? size - done : DUP_READ_BUFFER;
+                throttle_bytes(2 * block);
+                same = memcmp(ma + done, mb + done, block) == 0;
+            }
+        }
+        if (ma != MAP_FAILED) {
+            munmap(ma, size);
+        }
+        if (mb != MAP_FAILED) {
+            munmap(mb, size);
+        }
+    }
+    if (fa >= 0) {
+        close(fa);
+    }
+    if (fb >= 0) {
+        close(fb);
+    }
+    return same;
+}
+// Print the groups of duplicate files and return the number of bytes they waste
+// The hash only finds candidates, every member of a group is compared byte for byte with the first one.
+// Members that differ are compared again among themselves, so only files with equal content are printed together.
+off_t print_dup_groups(DupEntry *entries, int *indexes, int *groups, int count, int *group_count) {
+    off_t wasted = 0;
+    int *rest = (int *) malloc((count + 1) * sizeof(int));
+    int *same = (int *) malloc((count + 1) * sizeof(int));
+    for (int i = 0, j; i < count; i = j) {
+        int left = 0;
+        for (j = i; j < count && groups[j] == groups[i]; j++) {
+            rest[left++] = indexes[j];
+        }
+        while (left > 1) {
+            const DupEntry *first = &entries[rest[0]];
+            int matched = 1, remaining = 0;
+            same[0] = rest[0];
+            for (int k = 1; k < left; k++) {
+                if (same_file_content(first->file.path, entries[rest[k]].file.path, first->file.size)) {
+                    same[matched++] = rest[k];
+                } else {
+                    rest[remaining++] = rest[k];
+                }
+            }
+            left = remaining;
+            if (matched < 2) {
+                continue;
+            }
+            printf("------------------------------------------\nDuplicate files (size: %ld):\n", first->file.size);
+            for (int k = 0; k < matched; k++) {
+                printf("\t%s\n", entries[same[k]].file.path);
+            }
+            wasted += first->file.size * (matched - 1);
+            (*group_count)++;
+        }
+    }
+    free(same);
+    free(rest);
+    return wasted;
+}
+// Find regular files with identical content under the given paths and print them in groups
+void find_duplicate_files(char **paths, int count, int one_filesystem) {
+    FTS *fts;
+    FTSENT *entry;
+    int n = 0, capacity = 1024;
+
+    if (count == 0) {
+        printf("Error: No paths given\n");
+        return;
+    }
+    DupEntry *entries = (DupEntry *) malloc(capacity * sizeof(DupEntry));
+    char **path_argv = (char **) malloc((count + 1) * sizeof(char *));
+    memcpy(path_argv, paths, count * sizeof(char *));
+    path_argv[count] = NULL;
+    // Walk all paths at once and collect the non-empty regular files
+    fts = fts_open(path_argv, FTS_PHYSICAL | FTS_NOCHDIR | (one_filesystem ? FTS_XDEV : 0), NULL);
+    if (!fts) {
+        perror("fts_open");
+        return;
+    }
+    while ((entry = fts_read(fts)) != NULL) {
+        throttle_stats(1);
+        if (entry->fts_info == FTS_F && entry->fts_statp->st_size > 0) {
+            if (n == capacity) {
+                capacity *= 2;
+                entries = (DupEntry *) realloc(entries, capacity * sizeof(DupEntry));
+            }
+            memset(&entries[n], 0, sizeof(DupEntry));
+            entries[n].file.path = strdup(entry->fts_path);
+            entries[n].file.size = entry->fts_statp->st_size;
+            entries[n].file.hard_link = entry->fts_statp->st_nlink;
+            entries[n].dev = entry->fts_statp->st_dev;
+            entries[n].ino = entry->fts_statp->st_ino;
+            n++;
+        }
+    }
+    fts_close(fts);
+    free(path_argv);
+
+    // Hard links and paths given twice are the same file, keep one of them
+    qsort(entries, n, sizeof(DupEntry), compare_dup_inode);
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || compare_dup_inode(&entries[unique - 1], &entries[i]) != 0) {
+            entries[unique++] = entries[i];
+        }
+    }
+    n = unique;
+
+    // Group by size, only sizes shared by several files are hashed
+    qsort(entries, n, sizeof(DupEntry), compare_dup_size);
+    int *indexes = (int *) malloc((n + 1) * sizeof(int));
+    int *groups = (int *) malloc((n + 1) * sizeof(int));
+    int candidates = 0;
+    for (int i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && entries[j].file.size == entries[i].file.size; j++);
+        if (j - i > 1) {
+            for (int k = i; k < j; k++) {
+                indexes[candidates++] = k;
+            }
+        }
+    }
+    // Then by a hash of the first bytes
+    candidates = filter_dup_candidates(entries, indexes, groups, candidates, DUP_PARTIAL_BYTES);
+    // Small files are already hashed completely, the large ones get a full hash
+    int small = 0, large = 0;
+    int *large_indexes = (int *) malloc((candidates + 1) * sizeof(int));
+    for (int i = 0; i < candidates; i++) {
+        if (entries[indexes[i]].file.size > DUP_PARTIAL_BYTES) {
+            large_indexes[large++] = indexes[i];
+        } else {
+            indexes[small] = indexes[i];
+            groups[small++] = groups[i];
+        }
+    }
+    int *large_groups = (int *) malloc((large + 1) * sizeof(int));
+    large = filter_dup_candidates(entries, large_indexes, large_groups, large, 0);
+
+    int group_count = 0;
+    off_t wasted = print_dup_groups(entries, indexes, groups, small, &group_count);
+    wasted += print_dup_groups(entries, large_indexes, large_groups, large, &group_count);
+    printf("------------------------------------------\n");
+    printf("Files scanned: %d\nDuplicate groups: %d\nWasted bytes: %ld\n", n, group_count, wasted);
+
+    for (int i = 0; i < n; i++) {
+        free((char *) entries[i].file.path);
+    }
+    free(large_groups);
+    free(large_indexes);
+    free(groups);
+    free(indexes);
+    free(entries);
+}
+// Parse a filter rule and add it to the filter. Returns 0 on success.
+int add_filter_rule(DirFilter *filter, const char *rule) {
+    const char *value = strchr(rule, ':');
+    char *end;
+    if (value == NULL || value[1] == '\0') {
+        return -1;
+    }
+    value++;
+    int keyLen = value - rule - 1;
+    // Keep the rule text, the checkpoint uses it to tell walks with different filters apart
+    size_t textLen = filter->text ? strlen(filter->text) : 0;
+    filter->text = (char *) realloc(filter->text, textLen + strlen(rule) + 2);
+    sprintf(filter->text + textLen, "|%s", rule);
+    // Glob and regex rules are compiled into the rules list
+    if (keyLen == 1 && strchr("xiXI", rule[0]) != NULL) {
+        FilterRule r;
+        memset(&r, 0, sizeof(r));
+        r.kind = (rule[0] == 'x' || rule[0] == 'X') ? FILTER_EXCLUDE : FILTER_INCLUDE;
+        r.is_regex = (rule[0] == 'X' || rule[0] == 'I');
+        if (r.is_regex) {
+            if (regcomp(&r.regex, value, REG_EXTENDED | REG_NOSUB) != 0) {
+                return -1;
+            }
+        } else {
+            r.glob = strdup(value);
+        }
+        filter->rules = (FilterRule *) realloc(filter->rules, (filter->rule_count + 1) * sizeof(FilterRule));
+        filter->rules[filter->rule_count++] = r;
+        if (r.kind == FILTER_INCLUDE) {
+            filter->include_count++;
+        }
+        return 0;
+    }
+    // The other rules take a number
+    long long number = strtoll(value, &end, 10);
+    if (*end != '\0' || number < 0) {
+        return -1;
+    }
+    if (strncmp(rule, "depth:", keyLen + 1) == 0) {
+        filter->max_depth = number;
+    } else if (strncmp(rule, "min:", keyLen + 1) == 0) {
+        filter->min_size = number;
+    } else if (strncmp(rule, "max:", keyLen + 1) == 0) {
+        filter->max_size = number;
+    } else if (strncmp(rule, "newer:", keyLen + 1) == 0) {
+        filter->newer_than = time(NULL) - number * 24 * 60 * 60;
+    } else if (strncmp(rule, "older:", keyLen + 1) == 0) {
+        filter->older_than = time(NULL) - number * 24 * 60 * 60;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+// Check a rule against an entry name and path
+int filter_rule_matches(const FilterRule *rule, const char *name, const char *path) {
+    if (rule->is_regex) {
+        return regexec(&rule->regex, path, 0, NULL, 0) == 0;
+    }
+    return fnmatch(rule->glob, name, FNM_PERIOD) == 0;
+}
+// Returns 1 if the directory at the given depth must not be descended into
+int filter_skip_dir(const DirFilter *filter, const char *name, const char *path, int depth) {
+    // The directory given by the user is never skipped, only its depth is checked
+    if (filter->max_depth >= 0 && depth >= filter->max_depth) {
+        return 1;
+    }
+    if (depth == 0) {
+        return 0;
+    }
+    for (int i = 0; i < filter->rule_count; i++) {
+        if (filter->rules[i].kind == FILTER_EXCLUDE && filter_rule_matches(&filter->rules[i], name, path)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+// Returns 1 if the regular file passes the filter. st may be NULL when no size or time rule is set.
+int filter_match_file(const DirFilter *filter, const char *name, const char *path, const struct stat *st) {
+    int included = filter->include_count == 0;
+    for (int i = 0; i < filter->rule_count; i++) {
+        const FilterRule *rule = &filter->rules[i];
+        if (rule->kind == FILTER_EXCLUDE) {
+            if (filter_rule_matches(rule, name, path)) {
+                return 0;
+            }
+        } else if (!included && filter_rule_matches(rule, name, path)) {
+            included = 1;
+        }
+    }
+    if (!included) {
+        return 0;
+    }
+    if (st) {
+        if (filter->min_size >= 0 && st->st_size < filter->min_size) {
+            return 0;
+        }
+        if (filter->max_size >= 0 && st->st_size > filter->max_size) {
+            return 0;
+        }
+        if (filter->newer_than && st->st_mtime < filter->newer_than) {
+            return 0;
+        }
+        if (filter->older_than && st->st_mtime > filter->older_than) {
+            return 0;
+        }
+    }
+    return 1;
+}
+// Returns 1 if the device is a spinning disk, 0 if it isn't or can't be told
+int is_rotational_device(dev_t dev) {
+    char path[PATH_MAX];
+    FILE *fp;
+    int rotational = 0;
+    // Whole disks have a queue directory, partitions use the one of their parent disk
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+        fp = fopen(path, "r");
+    }
+    if (fp == NULL) {
+        return 0;
+    }
+    if (fscanf(fp, "%d", &rotational) != 1) {
+        rotational = 0;
+    }
+    fclose(fp);
+    return rotational;
+}
+// Create the shared rate limits of the run. Returns NULL when no limit is set.
+IoThrottle *create_io_throttle(const RunOptions *opts) {
+    if (opts->max_stats <= 0 && opts->max_read_bytes <= 0) {
+        return NULL;
+    }
+    IoThrottle *throttle = mmap(NULL, sizeof(IoThrottle),
+                                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+    if (throttle == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    memset(throttle, 0, sizeof(IoThrottle));
+    throttle->stats.rate = opts->max_stats;
+    throttle->bytes.rate = opts->max_read_bytes;
+    return throttle;
+}
+// Take count units from a shared bucket, sleeping until the rate allows them
+void rate_acquire(RateBucket *bucket, long long count) {
+    struct timespec ts;
+    long long now, next, slot, cost;
+    if (bucket->rate <= 0 || count <= 0) {
+        return;
+    }
+    cost = (long long) ((double) count * 1000000000.0 / bucket->rate);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    // Reserve the next free time slot, unused budget is kept for at most THROTTLE_BURST_NS
+    next = __atomic_load_n(&bucket->next_ns, __ATOMIC_RELAXED);
+    do {
+        slot = next > now - THROTTLE_BURST_NS ? next : now - THROTTLE_BURST_NS;
+    } while (!__atomic_compare_exchange_n(&bucket->next_ns, &next, slot + cost, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    // Sleep until the reserved slot starts
+    if (slot > now) {
+        ts.tv_sec = (slot - now) / 1000000000LL;
+        ts.tv_nsec = (slot - now) % 1000000000LL;
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+    }
+}
+// Wait until count more stat calls are allowed
+void throttle_stats(long count) {
+    if (io_throttle) {
+        rate_acquire(&io_throttle->stats, count);
+    }
+}
+// Wait until count more bytes may be read
+void throttle_bytes(long long count) {
+    if (io_throttle) {
+        rate_acquire(&io_throttle->bytes, count);
+    }
+}
+// Ask the kernel to start reading a file in the background, so it is cached by the time it is scanned
+// Only the first limit bytes are requested when limit is positive. Nothing is requested under a read
+// rate limit, since the background read would not be charged to it.
+void prefetch_file(const char *path, off_t limit) {
+    if (io_throttle && io_throttle->bytes.rate > 0) {
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) {
+        return;
+    }
+    posix_fadvise(fd, 0, limit > 0 && limit < PREFETCH_BYTES ? limit : PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+// Take a read buffer of at least size bytes from the pool of this process
+unsigned char *take_scan_buffer(size_t size) {
+    ScanBuffer *free_slot = NULL;
+    for (int i = 0; i < SCAN_BUFFER_POOL; i++) {
+        if (scan_buffers[i].in_use) {
+            continue;
+        }
+        if (scan_buffers[i].size >= size) {
+            scan_buffers[i].in_use = 1;
+            return scan_buffers[i].data;
+        }
+        free_slot = free_slot ? free_slot : &scan_buffers[i];
+    }
+    // Grow a free slot, or hand out a buffer outside the pool when all are taken
+    if (!free_slot) {
+        return (unsigned char *) malloc(size);
+    }
+    free(free_slot->data);
+    free_slot->data = (unsigned char *) malloc(size);
+    free_slot->size = free_slot->data ? size : 0;
+    free_slot->in_use = free_slot->data != NULL;
+    return free_slot->data;
+}
+// Return a buffer from take_scan_buffer
+void give_scan_buffer(unsigned char *data) {
+    for (int i = 0; i < SCAN_BUFFER_POOL; i++) {
+        if (scan_buffers[i].data == data && scan_buffers[i].in_use) {
+            scan_buffers[i].in_use = 0;
+            return;
+        }
+    }
+    free(data);
+}
+// Number of worker processes for items pieces of work, one per online CPU
+int worker_count(int items) {
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1) {
+        workers = 1;
+    }
+    return workers < items ? (int) workers : items;
+}
+// Fork count workers that each run work(worker, arg) and exit, returns their PIDs for wait_workers
+pid_t *start_workers(int count, void (*work)(int, void *), void *arg) {
+    pid_t *pids = (pid_t *) malloc(count * sizeof(pid_t));
+    fflush(stdout);
+    for (int w = 0; w < count; w++) {
+        pids[w] = fork();
+        if (pids[w] == 0) {
+            work(w, arg);
+            exit(0);
+        } else if (pids[w] < 0) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return pids;
+}
+// Wait for the workers of start_workers and free their PIDs
+void wait_workers(pid_t *pids, int count) {
+    for (int w = 0; w < count; w++) {
+        waitpid(pids[w], NULL, 0);
+    }
+    free(pids);
+}
+// Take items from the shared counter of a ParallelLoop until all are done
+void run_parallel_loop(int worker, void *arg) {
+    ParallelLoop *loop = (ParallelLoop *) arg;
+    int i;
+    while ((i = __atomic_fetch_add(loop->next, 1, __ATOMIC_RELAXED)) < loop->items) {
+        loop->item(i, worker, loop->arg);
+    }
+}
+// Run item(index, worker, arg) for every index below items in a pool of child processes
+// The children's own memory is lost when they exit, results have to go to shared memory.
+void parallel_for(int items, void (*item)(int, int, void *), void *arg) {
+    if (items <= 0) {
+        return;
+    }
+    int *next = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+    if (next == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    *next = 0;
+    ParallelLoop loop = {next, items, item, arg};
+    int workers = worker_count(items);
+    wait_workers(start_workers(workers, run_parallel_loop, &loop), workers);
+    munmap(next, sizeof(int));
+}
+// Create a private temporary directory under $TMPDIR or /tmp, returns 0 on success
+int make_temp_dir(char *path, size_t size) {
+    const char *base = getenv("TMPDIR");
+    if (base == NULL || base[0] == '\0') {
+        base = "/tmp";
+    }
+    if (snprintf(path, size, "%s/op_grade_XXXXXX", base) >= (int) size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return mkdtemp(path) ? 0 : -1;
+}
+// Split a checkpoint line on tabs into at most max fields. Returns the number of fields.
+int split_checkpoint_line(char *line, char **fields, int max) {
+    int n = 0;
+    while (n < max) {
+        fields[n++] = line;
+        line = strchr(line, '\t');
+        if (line == NULL) {
+            break;
+        }
+        *line++ = '\0';
+    }
+    return n;
+}
+// Open the checkpoint file. On resume the records of the earlier run are loaded and the file is
+// rewritten atomically with only the latest ones, otherwise it is started empty.
+Checkpoint *open_checkpoint(const char *file, int resume, int interval) {
+    Checkpoint *cp = (Checkpoint *) calloc(1, sizeof(Checkpoint));
+    char tmp[PATH_MAX];
+    cp->file = file;
+    cp->interval = interval;
+    FILE *fp = resume ? fopen(file, "r") : NULL;
+    if (fp) {
+        char *line = NULL, *fields[5];
+        size_t size = 0;
+        ssize_t len;
+        // A line cut short by a kill has no '\n' and is ignored
+        while ((len = getline(&line, &size, fp)) > 0) {
+            if (line[len - 1] != '\n') {
+                break;
+            }
+            line[len - 1] = '\0';
+            int n = split_checkpoint_line(line, fields, 5);
+            CheckpointRecord r;
+            memset(&r, 0, sizeof(r));
+            r.type = fields[0][0];
+            r.path = strdup(fields[1 < n ? 1 : 0]);
+            if (r.type == 'G' && n == 3) {
+                r.score = atof(fields[2]);
+            } else if ((r.type == 'S' || r.type == 'C') && n == 4) {
+                r.signature = strdup(fields[2]);
+                r.value = atoll(fields[3]);
+            } else if (r.type == 'P' && n == 5) {
+                r.signature = strdup(fields[2]);
+                r.value = atoll(fields[3]);
+                r.frontier = strdup(fields[4]);
+            } else {
+                continue;
+            }
+            cp->records = (CheckpointRecord *) realloc(cp->records, (cp->record_count + 1) * sizeof(CheckpointRecord));
+            cp->records[cp->record_count++] = r;
+        }
+        free(line);
+        fclose(fp);
+    }
+    // Write the latest record of each path to a temporary file and rename it over the old one
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        perror("Error opening checkpoint file");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < cp->record_count; i++) {
+        CheckpointRecord *r = &cp->records[i];
+        if (checkpoint_find_in(cp, r->type, r->path, r->signature) != r) {
+            continue;
+        }
+        if (r->type == 'P' && checkpoint_find_in(cp, 'S', r->path, r->signature)) {
+            continue;
+        }
+        if (r->type == 'G') {
+            fprintf(fp, "G\t%s\t%.17g\n", r->path, r->score);
+        } else if (r->type == 'P') {
+            fprintf(fp, "P\t%s\t%s\t%lld\t%s\n", r->path, r->signature, r->value, r->frontier);
+        } else {
+            fprintf(fp, "%c\t%s\t%s\t%lld\n", r->type, r->path, r->signature, r->value);
+        }
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 || fclose(fp) != 0 || rename(tmp, file) != 0) {
+        perror("Error writing checkpoint file");
+        exit(EXIT_FAILURE);
+    }
+    // New records are appended with one write each, so they can't be mixed up between processes
+    cp->fd = open(file, O_WRONLY | O_APPEND);
+    if (cp->fd < 0) {
+        perror("Error opening checkpoint file");
+        exit(EXIT_FAILURE);
+    }
+    return cp;
+}
+// Find the latest record of the given type and path in a checkpoint. signature is ignored for grades.
+const CheckpointRecord *checkpoint_find_in(const Checkpoint *cp, char type, const char *path, const char *signature) {
+    for (int i = cp->record_count - 1; i >= 0; i--) {
+        const CheckpointRecord *r = &cp->records[i];
+        if (r->type == type && strcmp(r->path, path) == 0
+            && (type == 'G' || strcmp(r->signature, signature) == 0)) {
+            return r;
+        }
+    }
+    return NULL;
+}
+// Find the latest record of the given type and path in the checkpoint of the run
+const CheckpointRecord *checkpoint_find(char type, const char *path, const char *signature) {
+    return checkpoint ? checkpoint_find_in(checkpoint, type, path, signature) : NULL;
+}
+// Append a record to the checkpoint file. Paths with tabs or new lines can't be saved and are left out.
+void checkpoint_append(const char *format, ...) {
+    char line[3 * PATH_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len <= 0 || len >= (int) sizeof(line) || strchr(line, '\n') != line + len - 1) {
+        return;
+    }
+    int tabs = 0;
+    for (char *p = line; (p = strchr(p, '\t')) != NULL; p++) {
+        tabs++;
+    }
+    int expected = line[0] == 'P' ? 4 : (line[0] == 'G' ? 2 : 3);
+    if (tabs != expected) {
+        return;
+    }
+    if (write(checkpoint->fd, line, len) != len) {
+        perror("Error writing checkpoint file");
+    }
+}
+// Build the text that tells walks of the same path with different options apart
+char *walk_signature(const DirFilter *filter, int one_filesystem) {
+    const char *rules = filter && filter->text ? filter->text : "";
+    char *signature = (char *) malloc(strlen(rules) + 8);
+    sprintf(signature, "x%d%s", one_filesystem, rules);
+    return signature;
+}
+// Compare fts entries by name so every walk visits them in the same order
+int compare_fts_names(const FTSENT **a, const FTSENT **b) {
+    return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+// Tell where a path comes in a name-sorted walk relative to the frontier path. Both start with
+// the same root of root_len chars. Returns WALK_BEFORE, WALK_SAME, WALK_AFTER or WALK_ANCESTOR.
+int walk_position(const char *path, const char *frontier, size_t root_len) {
+    const char *a = path + root_len, *b = frontier + root_len;
+    while (1) {
+        while (*a == '/') {
+            a++;
+        }
+        while (*b == '/') {
+            b++;
+        }
+        if (*a == '\0') {
+            return *b == '\0' ? WALK_SAME : WALK_ANCESTOR;
+        }
+        if (*b == '\0') {
+            // Inside the frontier directory
+            return WALK_BEFORE;
+        }
+        // Compare one name of each path the way strcmp compares the whole names
+        size_t la = strcspn(a, "/"), lb = strcspn(b, "/");
+        int cmp = memcmp(a, b, la < lb ? la : lb);
+        if (cmp == 0 && la != lb) {
+            cmp = la < lb ? -1 : 1;
+        }
+        if (cmp != 0) {
+            return cmp < 0 ? WALK_BEFORE : WALK_AFTER;
+        }
+        a += la;
+        b += lb;
+    }
+}
+// Compare snapshot paths for sorting
+int compare_snapshot_entries(const void *a, const void *b) {
+    return strcmp(((const SnapshotSortEntry *) a)->path, ((const SnapshotSortEntry *) b)->path);
+}
+// Walk the paths and save the metadata of every entry to a snapshot file sorted by path. Returns the exit code.
+int save_snapshot(const char *file, char **paths, int count, int one_filesystem) {
+    FTS *fts;
+    FTSENT *entry;
+    int n = 0, capacity = 1024;
+    size_t strings_size = 0, strings_capacity = 64 * 1024;
+    char tmp[PATH_MAX];
+
+    if (count == 0) {
+        printf("Error: No paths given\n");
+        return EXIT_FAILURE;
+    }
+    SnapshotRecord *records = (SnapshotRecord *) malloc(capacity * sizeof(SnapshotRecord));
+    char *strings = (char *) malloc(strings_capacity);
+    char **path_argv = (char **) malloc((count + 1) * sizeof(char *));
+    memcpy(path_argv, paths, count * sizeof(char *));
+    path_argv[count] = NULL;
+    fts = fts_open(path_argv, FTS_PHYSICAL | FTS_NOCHDIR | (one_filesystem ? FTS_XDEV : 0), NULL);
+    if (!fts) {
+        perror("fts_open");
+        return EXIT_FAILURE;
+    }
+    // Directory sizes and .c counts are summed into their records, fts_number holds the record index
+    while ((entry = fts_read(fts)) != NULL) {
+        throttle_stats(1);
+        if (entry->fts_info == FTS_DP) {
+            if (entry->fts_level > 0) {
+                records[entry->fts_parent->fts_number].size += records[entry->fts_number].size;
+            }
+            continue;
+        }
+        if (entry->fts_info == FTS_DNR || entry->fts_info == FTS_ERR || entry->fts_info == FTS_NS) {
+            continue;
+        }
+        if (n == capacity) {
+            capacity *= 2;
+            records = (SnapshotRecord *) realloc(records, capacity * sizeof(SnapshotRecord));
+        }
+        while (strings_size + entry->fts_pathlen + 1 > strings_capacity) {
+            strings_capacity *= 2;
+            strings = (char *) realloc(strings, strings_capacity);
+        }
+        SnapshotRecord *r = &records[n];
+        struct stat *st = entry->fts_statp;
+        memset(r, 0, sizeof(SnapshotRecord));
+        r->path_offset = strings_size;
+        memcpy(strings + strings_size, entry->fts_path, entry->fts_pathlen + 1);
+        strings_size += entry->fts_pathlen + 1;
+        r->inode = st->st_ino;
+        r->mtime = st->st_mtime;
+        r->mode = st->st_mode;
+        r->hard_link = st->st_nlink;
+        r->c_files = -1;
+        if (entry->fts_info == FTS_D) {
+            r->c_files = 0;
+            entry->fts_number = n;
+        } else {
+            r->size = st->st_size;
+            if (entry->fts_level > 0 && entry->fts_info == FTS_F) {
+                records[entry->fts_parent->fts_number].size += st->st_size;
+                if (strstr(entry->fts_name, ".c") != NULL) {
+                    records[entry->fts_parent->fts_number].c_files++;
+                }
+            }
+        }
+        n++;
+    }
+    fts_close(fts);
+    free(path_argv);
+
+    // Sort by path, a path given twice is saved once
+    SnapshotSortEntry *order = (SnapshotSortEntry *) malloc((n + 1) * sizeof(SnapshotSortEntry));
+    for (int i = 0; i < n; i++) {
+        order[i].path = strings + records[i].path_offset;
+        order[i].index = i;
+    }
+    qsort(order, n, sizeof(SnapshotSortEntry), compare_snapshot_entries);
+    int unique = 0;
+    for (int i = 0; i < n; i++) {
+        if (unique == 0 || strcmp(order[unique - 1].path, order[i].path) != 0) {
+            order[unique++] = order[i];
+        }
+    }
+
+    // Write the header, the records and the string table to a temporary file and rename it
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        perror("Error opening snapshot file");
+        return EXIT_FAILURE;
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = unique;
+    header.strings_offset = sizeof(SnapshotHeader) + unique * sizeof(SnapshotRecord);
+    // written counts the items fwrite stored, it must reach 2 + 2 * unique
+    size_t written = fwrite(&header, sizeof(header), 1, fp);
+    unsigned long long offset = 0;
+    for (int i = 0; i < unique; i++) {
+        SnapshotRecord r = records[order[i].index];
+        r.path_offset = offset;
+        offset += strlen(order[i].path) + 1;
+        written += fwrite(&r, sizeof(r), 1, fp);
+    }
+    for (int i = 0; i < unique; i++) {
+        written += fwrite(order[i].path, strlen(order[i].path) + 1, 1, fp);
+    }
+    // The string table size is known only now
+    header.strings_size = offset;
+    fseek(fp, 0, SEEK_SET);
+    written += fwrite(&header, sizeof(header), 1, fp);
+    // The data must be on disk before the rename, or a crash could leave an empty or torn snapshot
+    int failed = written != 2 + 2 * (size_t) unique || fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) != 0;
+    if (fclose(fp) != 0 || failed || rename(tmp, file) != 0) {
+        perror("Error writing snapshot file");
+        unlink(tmp);
+        return EXIT_FAILURE;
+    }
+    printf("Snapshot saved: %s (%d entries)\n", file, unique);
+    free(order);
+    free(strings);
+    free(records);
+    return 0;
+}
+// Map a snapshot file and check its header. Returns the header or NULL if invalid.
+const SnapshotHeader *map_snapshot(const char *file, size_t *length) {
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(file);
+        return NULL;
+    }
+    *length = st.st_size;
+    const SnapshotHeader *header = *length >= sizeof(SnapshotHeader)
+                                   ? mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "Error: %s is not a snapshot\n", file);
+        return NULL;
+    }
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+        || header->strings_offset != sizeof(SnapshotHeader) + header->count * sizeof(SnapshotRecord)
+        || header->strings_offset + header->strings_size != *length
+        || (header->strings_size > 0 && ((const char *) header)[*length - 1] != '\0')) {
+        fprintf(stderr, "Error: %s is not a snapshot\n", file);
+        munmap((void *) header, *length);
+        return NULL;
+    }
+    madvise((void *) header, *length, MADV_SEQUENTIAL);
+    return header;
+}
+// Print the differences between two snapshots with one merge over their sorted records. Returns the exit code.
+int diff_snapshots(const char *old_file, const char *new_file) {
+    size_t old_length, new_length;
+    const SnapshotHeader *old_snap = map_snapshot(old_file, &old_length);
+    const SnapshotHeader *new_snap = map_snapshot(new_file, &new_length);
+    if (old_snap == NULL || new_snap == NULL) {
+        return EXIT_FAILURE;
+    }
+    const SnapshotRecord *a = (const SnapshotRecord *) (old_snap + 1);
+    const SnapshotRecord *b = (const SnapshotRecord *) (new_snap + 1);
+    const char *a_strings = (const char *) old_snap + old_snap->strings_offset;
+    const char *b_strings = (const char *) new_snap + new_snap->strings_offset;
+    unsigned long long i = 0, j = 0;
+    long added = 0, removed = 0, grown = 0, shrunk = 0, perms = 0;
+    while (i < old_snap->count || j < new_snap->count) {
+        int cmp;
+        if (i == old_snap->count) {
+            cmp = 1;
+        } else if (j == new_snap->count) {
+            cmp = -1;
+        } else {
+            cmp = strcmp(a_strings + a[i].path_offset, b_strings + b[j].path_offset);
+        }
+        if (cmp < 0) {
+            printf("- %s\n", a_strings + a[i].path_offset);
+            removed++;
+            i++;
+        } else if (cmp > 0) {
+            printf("+ %s\n", b_strings + b[j].path_offset);
+            added++;
+            j++;
+        } else {
+            const char *path = b_strings + b[j].path_offset;
+            if (b[j].size > a[i].size) {
+                printf("> %s grew %lld -> %lld\n", path, a[i].size, b[j].size);
+                grown++;
+            } else if (b[j].size < a[i].size) {
+                printf("< %s shrank %lld -> %lld\n", path, a[i].size, b[j].size);
+                shrunk++;
+            }
+            if ((a[i].mode & 07777) != (b[j].mode & 07777)) {
+                printf("~ %s permissions %04o -> %04o\n", path, a[i].mode & 07777, b[j].mode & 07777);
+                perms++;
+            }
+            i++;
+            j++;
+        }
+    }
+    printf("------------------------------------------\n");
+    printf("Added: %ld\nRemoved: %ld\nGrown: %ld\nShrunk: %ld\nPermissions changed: %ld\n",
+           added, removed, grown, shrunk, perms);
+    munmap((void *) old_snap, old_length);
+    munmap((void *) new_snap, new_length);
+    return 0;
+}
+// Read the entries of a sampled directory: its own regular files are summed, subdirectories become children
+void list_estimate_node(EstimateNode *node, const DirFilter *filter, int one_filesystem, dev_t root_dev) {
+    DIR *dir = opendir(node->path);
+    struct dirent *entry;
+    struct stat st;
+    char path[PATH_MAX];
+    int capacity = 0;
+    node->listed = 1;
+    if (dir == NULL) {
+        node->complete = 1;
+        return;
+    }
+    int needStat = !filter || filter->min_size >= 0 || filter->max_size >= 0 || filter->newer_than || filter->older_than;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", node->path, entry->d_name);
+        // Regular files need their size, other entries only when d_type doesn't tell what they are
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_REG || (entry->d_type == DT_DIR && one_filesystem)) {
+            throttle_stats(1);
+            if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                continue;
+            }
+        } else {
+            st.st_mode = entry->d_type == DT_DIR ? S_IFDIR : 0;
+        }
+        if (S_ISREG(st.st_mode)) {
+            if (!filter || ((filter->max_depth < 0 || node->depth < filter->max_depth)
+                            && filter_match_file(filter, entry->d_name, path, needStat ? &st : NULL))) {
+                node->bytes += st.st_size;
+                node->files++;
+            }
+        } else if (S_ISDIR(st.st_mode)) {
+            if ((one_filesystem && st.st_dev != root_dev)
+                || (filter && filter_skip_dir(filter, entry->d_name, path, node->depth + 1))) {
+                continue;
+            }
+            if (node->child_count == capacity) {
+                capacity = capacity ? 2 * capacity : 8;
+                node->children = (EstimateNode **) realloc(node->children, capacity * sizeof(EstimateNode *));
+            }
+            EstimateNode *child = (EstimateNode *) calloc(1, sizeof(EstimateNode));
+            child->path = strdup(path);
+            child->depth = node->depth + 1;
+            node->children[node->child_count++] = child;
+        }
+    }
+    closedir(dir);
+    node->complete = node->child_count == 0;
+}
+// Take one sample of a subtree: the exact sizes of complete children plus a random incomplete child
+// sampled further and scaled up by the number of incomplete children. A subtree read completely
+// gives its exact totals.
+void probe_estimate_node(EstimateNode *node, const DirFilter *filter, int one_filesystem, dev_t root_dev,
+                         unsigned int *seed, double *bytes, double *files) {
+    if (!node->listed) {
+        list_estimate_node(node, filter, one_filesystem, root_dev);
+    }
+    double b = node->bytes, f = node->files;
+    int incomplete = 0;
+    EstimateNode *pick = NULL;
+    for (int i = 0; i < node->child_count; i++) {
+        EstimateNode *child = node->children[i];
+        if (child->complete) {
+            b += child->bytes;
+            f += child->files;
+        } else if (rand_r(seed) % ++incomplete == 0) {
+            // Reservoir choice gives every incomplete child the same chance
+            pick = child;
+        }
+    }
+    if (pick) {
+        double cb, cf;
+        probe_estimate_node(pick, filter, one_filesystem, root_dev, seed, &cb, &cf);
+        b += incomplete * cb;
+        f += incomplete * cf;
+    }
+    *bytes = b;
+    *files = f;
+    if (node->complete) {
+        return;
+    }
+    // Once all children are complete the totals of this directory are exact, the children can go
+    for (int i = 0; i < node->child_count; i++) {
+        if (!node->children[i]->complete) {
+            return;
+        }
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        node->bytes += node->children[i]->bytes;
+        node->files += node->children[i]->files;
+        free(node->children[i]->path);
+        free(node->children[i]);
+    }
+    free(node->children);
+    node->children = NULL;
+    node->child_count = 0;
+    node->complete = 1;
+}
+// Free a sampled subtree
+void free_estimate_node(EstimateNode *node) {
+    for (int i = 0; i < node->child_count; i++) {
+        free_estimate_node(node->children[i]);
+    }
+    free(node->children);
+    free(node->path);
+    free(node);
+}
+// Square root by Newton's method, so the program doesn't need libm
+double square_root(double x) {
+    double r = x > 1 ? x : 1;
+    if (x <= 0) {
+        return 0;
+    }
+    for (int i = 0; i < 100 && r * r - x > x * 1e-15; i++) {
+        r = (r + x / r) / 2;
+    }
+    return r;
+}
+// Estimate the total size and file count of a directory by random sampling until the time budget
+// runs out. Samples get more precise as more of the tree is read and the result is exact once the
+// whole tree has been read.
+SizeEstimate estimate_directory_size(const char *path, const DirFilter *filter, int one_filesystem, int budget_ms) {
+    SizeEstimate est;
+    struct timespec ts;
+    struct stat st;
+    double sum_b = 0, sum_b2 = 0, sum_f = 0, sum_f2 = 0, b, f;
+    unsigned int seed = time(NULL) ^ getpid();
+    memset(&est, 0, sizeof(est));
+    if (stat(path, &st) != 0) {
+        return est;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long deadline = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + budget_ms;
+    EstimateNode *root = (EstimateNode *) calloc(1, sizeof(EstimateNode));
+    root->path = strdup(path);
+    // Take samples until the deadline, at least one
+    do {
+        probe_estimate_node(root, filter, one_filesystem, st.st_dev, &seed, &b, &f);
+        sum_b += b;
+        sum_b2 += b * b;
+        sum_f += f;
+        sum_f2 += f * f;
+        est.samples++;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    } while (!root->complete && ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 < deadline);
+    if (root->complete) {
+        est.size = root->bytes;
+        est.files = root->files;
+        est.exact = 1;
+    } else {
+        // Mean of the samples with 1.96 standard errors for the 95% interval
+        int n = est.samples;
+        est.size = sum_b / n;
+        est.files = sum_f / n;
+        if (n > 1) {
+            double var_b = (sum_b2 - sum_b * sum_b / n) / (n - 1);
+            double var_f = (sum_f2 - sum_f * sum_f / n) / (n - 1);
+            est.size_error = 1.96 * square_root(var_b > 0 ? var_b / n : 0);
+            est.files_error = 1.96 * square_root(var_f > 0 ? var_f / n : 0);
+        }
+    }
+    free_estimate_node(root);
+    return est;
+}
+// Run gcc with the given arguments under the grading limits and wait for it. gcc gets its own process group,
+// when the wall clock limit runs out the whole group is killed. The diagnostics are returned in *output
+// (NUL terminated, free it) when output isn't NULL. Returns the wait status, or -1 when gcc couldn't be
+// started or was killed for taking too long.
+int run_gcc(char **args, char **output, size_t *length) {
+    int fd[2];
+    if (pipe(fd) != 0) {
+        return -1;
+    }
+    fflush(stdout);
+    pid_t p = fork();
+    if (p == 0) {
+        close(fd[0]);
+        dup2(fd[1], 2);
+        close(fd[1]);
+        setpgid(0, 0);
+        apply_grade_rlimits();
+        execvp("gcc", args);
+        exit(127);
+    } else if (p < 0) {
+        perror("fork");
+        close(fd[0]);
+        close(fd[1]);
+        return -1;
+    }
+    // Also set from here, so the group exists before a kill can be sent to it
+    setpgid(p, p);
+    close(fd[1]);
+
+    // Read the diagnostics until gcc and everything it started are done or the time is up
+    size_t len = 0, capacity = 64 * 1024;
+    char *text = (char *) malloc(capacity);
+    int timed_out = 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long deadline = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + grade_limits.wall_seconds * 1000;
+    struct pollfd pfd = {fd[0], POLLIN, 0};
+    while (1) {
+        int wait_ms = -1;
+        if (grade_limits.wall_seconds > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            long long left = deadline - (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+            wait_ms = left > 0 ? (int) left : 0;
+        }
+        int ready = poll(&pfd, 1, wait_ms);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready == 0) {
+            timed_out = 1;
+            kill(-p, SIGKILL);
+            break;
+        }
+        ssize_t r = ready > 0 ? read(fd[0], text + len, capacity - len - 1) : -1;
+        if (r <= 0) {
+            break;
+        }
+        len += r;
+        if (len == capacity - 1) {
+            capacity *= 2;
+            text = (char *) realloc(text, capacity);
+        }
+    }
+    close(fd[0]);
+    int st;
+    waitpid(p, &st, 0);
+    text[len] = '\0';
+    if (output) {
+        *output = text;
+        *length = len;
+    } else {
+        free(text);
+    }
+    return timed_out ? -1 : st;
+}
+// Get the header of the first "#include <...>" of a C file if nothing but comments comes before it. Returns 1 if found.
+int first_system_include(const char *path, char *name, size_t size) {
+    char text[4096];
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    size_t len = fread(text, 1, sizeof(text) - 1, fp);
+    fclose(fp);
+    text[len] = '\0';
+    char *p = text;
+    // Skip white space and comments
+    while (1) {
+        p += strspn(p, " \t\r\n");
+        if (strncmp(p, "//", 2) == 0) {
+            p += strcspn(p, "\n");
+        } else if (strncmp(p, "/*", 2) == 0 && strstr(p + 2, "*/")) {
+            p = strstr(p + 2, "*/") + 2;
+        } else {
+            break;
+        }
+    }
+    if (*p++ != '#') {
+        return 0;
+    }
+    p += strspn(p, " \t");
+    if (strncmp(p, "include", 7) != 0) {
+        return 0;
+    }
+    p += 7;
+    p += strspn(p, " \t");
+    if (*p++ != '<') {
+        return 0;
+    }
+    // Only plain header names, headers in subdirectories are left alone
+    size_t n = strspn(p, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.-");
+    if (n == 0 || n >= size || p[n] != '>') {
+        return 0;
+    }
+    memcpy(name, p, n);
+    name[n] = '\0';
+    return 1;
+}
+// Precompile the system headers that several submissions include first into dir/pch. The headers
+// are compiled with the same flags as the submissions, gcc uses a precompiled header only if it fits
+// and falls back to the real header silently. Returns 1 if any header was precompiled.
+int build_common_headers(char **paths, int count, const char *dir) {
+    char (*names)[NAME_MAX + 1] = malloc((count + 1) * sizeof(*names));
+    int *uses = (int *) calloc(count + 1, sizeof(int));
+    int name_count = 0, built = 0;
+    char src[PATH_MAX], out[PATH_MAX], name[NAME_MAX + 1];
+    for (int i = 0; i < count; i++) {
+        if (!first_system_include(paths[i], name, sizeof(name))) {
+            continue;
+        }
+        int k;
+        for (k = 0; k < name_count && strcmp(names[k], name) != 0; k++);
+        if (k == name_count) {
+            strcpy(names[name_count++], name);
+        }
+        uses[k]++;
+    }
+    snprintf(src, sizeof(src), "%s/src", dir);
+    snprintf(out, sizeof(out), "%s/pch", dir);
+    mkdir(src, 0700);
+    mkdir(out, 0700);
+    for (int k = 0; k < name_count; k++) {
+        if (uses[k] < 2) {
+            continue;
+        }
+        // A header in src that only includes the system header, compiled to pch/<name>.gch
+        snprintf(src, sizeof(src), "%s/src/%s", dir, names[k]);
+        snprintf(out, sizeof(out), "%s/pch/%s.gch", dir, names[k]);
+        char line[NAME_MAX + 16];
+        sprintf(line, "#include <%s>\n", names[k]);
+        create_file(src, line);
+        char *args[] = {"gcc", "-Wall", "-x", "c-header", src, "-o", out, NULL};
+        if (run_gcc(args, NULL, NULL) == 0) {
+            built = 1;
+        } else {
+            unlink(out);
+        }
+    }
+    free(uses);
+    free(names);
+    return built;
+}
+// Returns the index of the batch file whose path starts the line, followed by ':', or -1
+int match_batch_path(const char *line, size_t len, char **paths, int count) {
+    for (int i = 0; i < count; i++) {
+        size_t n = strlen(paths[i]);
+        if (n < len && memcmp(line, paths[i], n) == 0 && line[n] == ':') {
+            return i;
+        }
+    }
+    return -1;
+}
+// Check a batch of submissions with one gcc -fsyntax-only run. The output of gcc comes file after file,
+// so every line is given to the file being compiled. A file whose own lines hold "error" gets score 1,
+// the same as a full compile, since a full compile shows the same front end errors and stops there.
+// Files whose lines can't be told apart for sure, or aren't plain ASCII for grep, are left unresolved.
+void screen_grade_batch(char **paths, int count, const char *include_dir, double *scores, int *resolved) {
+    char **args = (char **) malloc((count + 8) * sizeof(char *));
+    int n = 0;
+    args[n++] = "gcc";
+    args[n++] = "-Wall";
+    if (include_dir) {
+        args[n++] = "-I";
+        args[n++] = (char *) include_dir;
+    }
+    args[n++] = "-fsyntax-only";
+    for (int i = 0; i < count; i++) {
+        args[n++] = paths[i];
+    }
+    args[n] = NULL;
+    // Each cc1 of the batch gets the limits of a single compile. A batch that runs out of time stays
+    // unresolved, its files are then compiled one by one with their own limits.
+    size_t len = 0;
+    char *text = NULL;
+    int status = run_gcc(args, &text, &len);
+    free(args);
+
+    int *error = (int *) calloc(count, sizeof(int));
+    int *plain = (int *) malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        plain[i] = 1;
+    }
+    int cur = -1, after_include = 0, included = 0, reliable = (status != -1);
+    for (char *line = text; reliable && line < text + len;) {
+        char *end = memchr(line, '\n', text + len - line);
+        size_t line_len = end ? (size_t) (end - line) : (size_t) (text + len - line);
+        const char *from = line;
+        size_t from_len = line_len;
+        int is_include = 0;
+        // Include chains name the submission on their "In file included from" and "from" lines
+        if (line_len > 22 && strncmp(line, "In file included from ", 22) == 0) {
+            is_include = 1;
+            from = line + 22;
+        } else if (after_include && line_len > 0 && line[0] == ' ') {
+            size_t spaces = strspn(line, " ");
+            if (strncmp(line + spaces, "from ", 5) == 0) {
+                is_include = 1;
+                from = line + spaces + 5;
+            }
+        }
+        from_len = line_len - (from - line);
+        int j = match_batch_path(from, from_len, paths, count);
+        if (strncmp(line, "gcc:", 4) == 0 || strncmp(line, "cc1:", 4) == 0) {
+            // Driver messages can't be given to a file for sure
+            reliable = 0;
+            break;
+        }
+        if (is_include) {
+            // The last line of a chain, ending in ':', names the file being compiled. The lines that
+            // follow are about an included file until that file's own path shows up again.
+            if (line[line_len - 1] == ':') {
+                if (j < cur) {
+                    reliable = 0;
+                    break;
+                }
+                cur = j;
+                included = 1;
+            }
+        } else if (j >= 0 && j == cur) {
+            included = 0;
+        } else if (j >= 0) {
+            // A batch file named inside an include context may be a submission included by another
+            // one, and going back to an earlier file can't be right, so neither is given to a file
+            if (included || j < cur) {
+                reliable = 0;
+                break;
+            }
+            cur = j;
+        }
+        after_include = is_include;
+        if (cur < 0) {
+            reliable = 0;
+            break;
+        }
+        for (size_t k = 0; k < line_len; k++) {
+            unsigned char c = line[k];
+            if (c == 0 || c >= 0x80) {
+                plain[cur] = 0;
+            }
+        }
+        for (size_t k = 0; k + 5 <= line_len && !error[cur]; k++) {
+            if (memcmp(line + k, "error", 5) == 0) {
+                error[cur] = 1;
+            }
+        }
+        line += line_len + 1;
+    }
+    if (reliable) {
+        for (int i = 0; i < count; i++) {
+            if (error[i] && plain[i]) {
+                scores[i] = calculateScore(1, 0);
+                resolved[i] = 1;
+            }
+        }
+    }
+    free(plain);
+    free(error);
+    free(text);
+}
+// Remove a directory tree
+void remove_tree(const char *path) {
+    char *path_argv[] = {(char *) path, NULL};
+    FTS *fts = fts_open(path_argv, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+    FTSENT *entry;
+    if (!fts) {
+        return;
+    }
+    while ((entry = fts_read(fts)) != NULL) {
+        if (entry->fts_info == FTS_DP) {
+            rmdir(entry->fts_path);
+        } else if (entry->fts_info != FTS_D) {
+            unlink(entry->fts_path);
+        }
+    }
+    fts_close(fts);
+}
+// Compile file i of a CompileJob, each worker writes its programs to its own output file
+void compile_job_file(int i, int worker, void *arg) {
+    CompileJob *job = (CompileJob *) arg;
+    char output[PATH_MAX];
+    snprintf(output, sizeof(output), "%s/prog%d", job->dir, worker);
+    CompileOptions options = {job->include_dir, output};
+    job->scores[i] = compile_file_in_child(job->paths[job->pending[i]], &options);
+}
+// Grade many .c files together. Common headers are precompiled once, batches of files go through
+// one gcc syntax check so files with errors need no full compile, and the rest are compiled by
+// child processes in parallel. Every score is the one compile_file_in_child gives for the file alone.
+void grade_files_batch(char **paths, int count, double *scores) {
+    // Leave room for the names added under the directory
+    char dir[PATH_MAX - 64];
+    char pch[PATH_MAX];
+    if (count == 0) {
+        return;
+    }
+    if (make_temp_dir(dir, sizeof(dir)) != 0) {
+        perror("mkdtemp");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(pch, sizeof(pch), "%s/pch", dir);
+    const char *include_dir = build_common_headers(paths, count, dir) ? pch : NULL;
+
+    // Syntax check the files in batches, a path given twice or looking like an option isn't batched
+    int *resolved = (int *) calloc(count, sizeof(int));
+    char **batch = (char **) malloc(GRADE_BATCH_SIZE * sizeof(char *));
+    int *batch_index = (int *) malloc(GRADE_BATCH_SIZE * sizeof(int));
+    double *batch_scores = (double *) malloc(GRADE_BATCH_SIZE * sizeof(double));
+    int *batch_resolved = (int *) malloc(GRADE_BATCH_SIZE * sizeof(int));
+    for (int i = 0; i < count && i < GRADE_BATCH_SIZE; i++) {
+        prefetch_file(paths[i], 0);
+    }
+    for (int i = 0; i < count;) {
+        int n = 0;
+        for (; i < count && n < GRADE_BATCH_SIZE; i++) {
+            int dup = paths[i][0] == '-';
+            for (int k = 0; k < i && !dup; k++) {
+                dup = strcmp(paths[k], paths[i]) == 0;
+            }
+            if (!dup) {
+                batch[n] = paths[i];
+                batch_index[n++] = i;
+            }
+        }
+        // Request the sources of the next batch while gcc reads this one
+        for (int k = i; k < count && k < i + GRADE_BATCH_SIZE; k++) {
+            prefetch_file(paths[k], 0);
+        }
+        memset(batch_resolved, 0, GRADE_BATCH_SIZE * sizeof(int));
+        screen_grade_batch(batch, n, include_dir, batch_scores, batch_resolved);
+        for (int k = 0; k < n; k++) {
+            if (batch_resolved[k]) {
+                scores[batch_index[k]] = batch_scores[k];
+                resolved[batch_index[k]] = 1;
+            }
+        }
+    }
+    free(batch_resolved);
+    free(batch_scores);
+    free(batch_index);
+    free(batch);
+
+    // Compile the remaining files in child processes, each writing its score to shared memory
+    int *pending = (int *) malloc(count * sizeof(int));
+    int pending_count = 0;
+    for (int i = 0; i < count; i++) {
+        if (!resolved[i]) {
+            pending[pending_count++] = i;
+        }
+    }
+    if (pending_count > 0) {
+        double *shared = mmap(NULL, pending_count * sizeof(double),
+                              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, 0, 0);
+        if (shared == MAP_FAILED) {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+        CompileJob job = {paths, pending, shared, dir, include_dir};
+        parallel_for(pending_count, compile_job_file, &job);
+        for (int i = 0; i < pending_count; i++) {
+            scores[pending[i]] = shared[i];
+        }
+        munmap(shared, pending_count * sizeof(double));
+    }
+    free(pending);
+    free(resolved);
+    remove_tree(dir);
+}
+// Set the grading resource limits on the calling process, the programs it runs inherit them
+void apply_grade_rlimits(void) {
+    struct rlimit rl;
+    rl.rlim_cur = rl.rlim_max = 0;
+    setrlimit(RLIMIT_CORE, &rl);
+    if (grade_limits.memory_mb > 0) {
+        rl.rlim_cur = rl.rlim_max = (rlim_t) grade_limits.memory_mb << 20;
+        setrlimit(RLIMIT_AS, &rl);
+    }
+    if (grade_limits.cpu_seconds > 0) {
+        // SIGXCPU at the soft limit, SIGKILL a second later
+        rl.rlim_cur = grade_limits.cpu_seconds;
+        rl.rlim_max = grade_limits.cpu_seconds + 1;
+        setrlimit(RLIMIT_CPU, &rl);
+    }
+    if (grade_limits.output_mb > 0) {
+        rl.rlim_cur = rl.rlim_max = (rlim_t) grade_limits.output_mb << 20;
+        setrlimit(RLIMIT_FSIZE, &rl);
+    }
+}
+// Get the name of the limit a SCORE_LIMIT value stands for
+const char *score_limit_name(double score) {
+    if (score == SCORE_LIMIT_MEMORY) {
+        return "memory";
+    } else if (score == SCORE_LIMIT_CPU) {
+        return "cpu time";
+    } else if (score == SCORE_LIMIT_OUTPUT) {
+        return "output size";
+    } else if (score == SCORE_LIMIT_TIME) {
+        return "wall time";
+    }
+    return "unknown";
+}
+// Check compile output for a message of one of gcc's own programs, e.g. "cc1: out of memory allocating".
+// Only lines that start with a program name count. Diagnostics start with "file:line:col" and the
+// quoted source lines under them with a space, so text from a submission can't fake a message.
+// tool is the base name of the program, NULL matches any.
+int compile_tool_message(const char *text, const char *tool, const char *message) {
+    for (const char *line = text; *line; ) {
+        const char *end = strchr(line, '\n');
+        size_t line_len = end ? (size_t) (end - line) : strlen(line);
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", (int) line_len, line);
+        char *colon = strstr(name, ": ");
+        if (name[0] != ' ' && colon) {
+            *colon = '\0';
+            const char *base = strrchr(name, '/') ? strrchr(name, '/') + 1 : name;
+            if (!strchr(name, ':') && (!tool || strcmp(base, tool) == 0) && strstr(colon + 2, message)) {
+                return 1;
+            }
+            // The message may be the whole line, as in "virtual memory exhausted: Cannot allocate memory"
+            if (!strchr(name, ':') && !tool && strcmp(name, message) == 0) {
+                return 1;
+            }
+        }
+        line += line_len + (end != NULL);
+    }
+    return 0;
+}
+// Check compile output for a program that ran out of address space
+int compile_ran_out_of_memory(const char *text) {
+    return compile_tool_message(text, "cc1", "out of memory allocating")
+           || compile_tool_message(text, NULL, "virtual memory exhausted")
+           || compile_tool_message(text, NULL, "failed to map segment from shared object")
+           // cc1 can also crash when an allocation fails under the address space limit
+           || (grade_limits.memory_mb > 0
+               && compile_tool_message(text, "gcc", "Segmentation fault signal terminated program"));
+}
+// Write a short text to an existing file such as a cgroup control file. Returns 0 on success.
+int write_text_file(const char *path, const char *text) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    int ok = write(fd, text, strlen(text)) == (ssize_t) strlen(text);
+    close(fd);
+    return ok ? 0 : -1;
+}
+// Create a cgroup v2 group below our own one with the memory limit of a grading compile.
+// Returns 1 and its path if the cgroup tree is writable and has the memory controller, 0 otherwise.
+int create_grade_cgroup(char *path, size_t size) {
+    static int counter = 0;
+    char line[PATH_MAX], file[PATH_MAX + 32], limit[32];
+    if (grade_limits.memory_mb <= 0) {
+        return 0;
+    }
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    // The cgroup v2 entry looks like "0::/path"
+    int found = 0;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        found = strncmp(line, "0::", 3) == 0;
+    }
+    fclose(fp);
+    if (!found) {
+        return 0;
+    }
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(path, size, "/sys/fs/cgroup%s/op_grade_%d_%d", strcmp(line + 3, "/") == 0 ? "" : line + 3,
+             getpid(), counter++);
+    if (mkdir(path, 0755) != 0) {
+        return 0;
+    }
+    snprintf(file, sizeof(file), "%s/memory.max", path);
+    snprintf(limit, sizeof(limit), "%ld", grade_limits.memory_mb << 20);
+    if (write_text_file(file, limit) != 0) {
+        rmdir(path);
+        return 0;
+    }
+    snprintf(file, sizeof(file), "%s/memory.swap.max", path);
+    write_text_file(file, "0");
+    return 1;
+}
+// Add a score to a grade summary, a compile stopped by a limit is only counted
+void add_grade(GradeSummary *summary, double score) {
+    if (score < 0) {
+        summary->limited++;
+        return;
+    }
+    if (summary->count == 0 || score < summary->min) {
+        summary->min = score;
+    }
+    if (summary->count == 0 || score > summary->max) {
+        summary->max = score;
+    }
+    summary->count++;
+    summary->sum += score;
+}
+// Add the score of a task to its directory and the total. New scores go to grades.txt and the checkpoint.
+void record_grade(GradeWalk *walk, int id, double score, int graded_before) {
+    const char *path = walk->task_paths[id];
+    add_grade(&walk->dirs[0], score);
+    if (walk->task_dirs[id] > 0) {
+        add_grade(&walk->dirs[walk->task_dirs[id]], score);
+    }
+    if (graded_before) {
+        return;
+    }
+    char filecontent[100];
+    if (score < 0) {
+        snprintf(filecontent, sizeof(filecontent), "%s:limit exceeded (%s)\n", get_folder_name(path), score_limit_name(score));
+    } else {
+        snprintf(filecontent, sizeof(filecontent), "%s:%lf\n", get_folder_name(path), score);
+    }
+    create_file("grades.txt", filecontent);
+    if (checkpoint) {
+        checkpoint_append("G\t%s\t%.17g\n", path, score);
+    }
+}
+// Read the scores the workers sent back, waits for one when block is set
+void collect_grade_replies(GradeWalk *walk, int block) {
+    GradeReply reply;
+    struct pollfd pfd = {walk->reply_fd, POLLIN, 0};
+    while (walk->pending > 0 && poll(&pfd, 1, block ? -1 : 0) > 0) {
+        if (read(walk->reply_fd, &reply, sizeof(reply)) != sizeof(reply)) {
+            // The workers are gone, the scores of their tasks are lost
+            walk->pending = 0;
+            return;
+        }
+        record_grade(walk, reply.id, reply.score, 0);
+        walk->pending--;
+        block = 0;
+    }
+}
+// Send a task to the workers, collecting scores while the task pipe is full so neither side blocks the other
+void send_grade_task(GradeWalk *walk, const GradeTask *task) {
+    struct pollfd pfds[2] = {{walk->task_fd, POLLOUT, 0}, {walk->reply_fd, POLLIN, 0}};
+    while (write(walk->task_fd, task, sizeof(GradeTask)) != sizeof(GradeTask)) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("write");
+            return;
+        }
+        poll(pfds, 2, -1);
+        if (pfds[1].revents) {
+            collect_grade_replies(walk, 0);
+        }
+    }
+    walk->pending++;
+    collect_grade_replies(walk, 0);
+}
+// Compile the tasks read from the task pipe and send their scores back until the pipe is closed
+void grade_worker(int w, void *arg) {
+    GradeWorker *worker = (GradeWorker *) arg;
+    close(worker->task_pipe[1]);
+    close(worker->reply_pipe[0]);
+    char output[PATH_MAX];
+    snprintf(output, sizeof(output), "%s/prog%d", worker->dir, w);
+    CompileOptions options = {NULL, output};
+    GradeTask task;
+    while (read(worker->task_pipe[0], &task, sizeof(task)) == sizeof(task)) {
+        GradeReply reply = {task.id, compile_file_in_child(task.path, &options)};
+        if (write(worker->reply_pipe[1], &reply, sizeof(reply)) != sizeof(reply)) {
+            break;
+        }
+    }
+}
+// Grade every .c file under path that passes the filter. The walk feeds a pool of workers through a pipe,
+// so compiling starts with the first file found. Files with a G record in the checkpoint are not compiled
+// again. The summary of each directory is written to *report and the total is returned.
+GradeSummary grade_directory(const char *path, const DirFilter *filter, int one_filesystem, char **report) {
+    GradeWalk walk = {0};
+    int dir_capacity = 16, task_capacity = 64;
+    walk.dirs = (GradeSummary *) calloc(dir_capacity, sizeof(GradeSummary));
+    walk.task_paths = (char **) malloc(task_capacity * sizeof(char *));
+    walk.task_dirs = (int *) malloc(task_capacity * sizeof(int));
+    walk.dirs[0].path = "Total";
+    walk.dir_count = 1;
+
+    // Start the workers, each compiles into its own output file in a temporary directory
+    char dir[PATH_MAX];
+    int task_pipe[2], reply_pipe[2];
+    if (make_temp_dir(dir, sizeof(dir)) != 0 || pipe(task_pipe) < 0 || pipe(reply_pipe) < 0) {
+        perror("grade_directory");
+        exit(EXIT_FAILURE);
+    }
+    GradeWorker worker = {task_pipe, reply_pipe, dir};
+    int workers = worker_count(INT_MAX);
+    pid_t *pids = start_workers(workers, grade_worker, &worker);
+    close(task_pipe[0]);
+    close(reply_pipe[1]);
+    walk.task_fd = task_pipe[1];
+    walk.reply_fd = reply_pipe[0];
+    fcntl(walk.task_fd, F_SETFL, O_NONBLOCK);
+
+    char *path_argv[] = {(char *) path, NULL};
+    int fts_options = FTS_PHYSICAL | FTS_NOCHDIR;
+    if (one_filesystem) {
+        fts_options |= FTS_XDEV;
+    }
+    FTS *fts = fts_open(path_argv, fts_options, NULL);
+    FTSENT *entry;
+    GradeTask task;
+    if (!fts) {
+        perror("fts_open");
+    }
+    while (fts && (entry = fts_read(fts)) != NULL) {
+        throttle_stats(1);
+        if (entry->fts_info == FTS_D) {
+            if (filter && filter_skip_dir(filter, entry->fts_name, entry->fts_path, entry->fts_level)) {
+                fts_set(fts, entry, FTS_SKIP);
+                continue;
+            }
+            // fts_number holds the summary index of a directory
+            if (walk.dir_count == dir_capacity) {
+                dir_capacity *= 2;
+                walk.dirs = (GradeSummary *) realloc(walk.dirs, dir_capacity * sizeof(GradeSummary));
+            }
+            memset(&walk.dirs[walk.dir_count], 0, sizeof(GradeSummary));
+            walk.dirs[walk.dir_count].path = strdup(entry->fts_path);
+            entry->fts_number = walk.dir_count++;
+            continue;
+        }
+        if (entry->fts_info != FTS_F || !check_file_extension(entry->fts_name, ".c")
+            || (filter && !filter_match_file(filter, entry->fts_name, entry->fts_path, entry->fts_statp))) {
+            continue;
+        }
+        if (entry->fts_pathlen >= sizeof(task.path)) {
+            printf("Error: Path too long to grade %s\n", entry->fts_path);
+            continue;
+        }
+        if (walk.task_count == task_capacity) {
+            task_capacity *= 2;
+            walk.task_paths = (char **) realloc(walk.task_paths, task_capacity * sizeof(char *));
+            walk.task_dirs = (int *) realloc(walk.task_dirs, task_capacity * sizeof(int));
+        }
+        int id = walk.task_count++;
+        walk.task_paths[id] = strdup(entry->fts_path);
+        walk.task_dirs[id] = entry->fts_parent->fts_number;
+        // A file graded by an earlier run is already in grades.txt
+        const CheckpointRecord *done = checkpoint ? checkpoint_find('G', entry->fts_path, NULL) : NULL;
+        if (done) {
+            record_grade(&walk, id, done->score, 1);
+            continue;
+        }
+        task.id = id;
+        strcpy(task.path, entry->fts_path);
+        send_grade_task(&walk, &task);
+    }
+    if (fts) {
+        fts_close(fts);
+    }
+
+    // No more tasks, the workers exit once the pipe is drained
+    close(walk.task_fd);
+    while (walk.pending > 0) {
+        collect_grade_replies(&walk, 1);
+    }
+    close(walk.reply_fd);
+    wait_workers(pids, workers);
+    remove_tree(dir);
+
+    // One line for every directory with graded files, then the total
+    size_t size = 256, used = 0;
+    char *text = (char *) malloc(size);
+    text[0] = '\0';
+    for (int d = 1; d <= walk.dir_count; d++) {
+        const GradeSummary *summary = &walk.dirs[d % walk.dir_count];
+        if (summary->count == 0 && summary->limited == 0 && d < walk.dir_count) {
+            continue;
+        }
+        while (size - used < strlen(summary->path) + 160) {
+            size *= 2;
+            text = (char *) realloc(text, size);
+        }
+        used += sprintf(text + used, "%s: count %d", summary->path, summary->count);
+        if (summary->count > 0) {
+            used += sprintf(text + used, ", mean %lf, min %lf, max %lf", summary->sum / summary->count,
+                            summary->min, summary->max);
+        }
+        if (summary->limited > 0) {
+            used += sprintf(text + used, ", limit exceeded %d", summary->limited);
+        }
+        used += sprintf(text + used, "\n");
+    }
+    *report = text;
+
+    GradeSummary total = walk.dirs[0];
+    for (int d = 1; d < walk.dir_count; d++) {
+        free((char *) walk.dirs[d].path);
+    }
+    for (int i = 0; i < walk.task_count; i++) {
+        free(walk.task_paths[i]);
+    }
+    free(walk.task_paths);
+    free(walk.task_dirs);
+    free(walk.dirs);
+    return total;
+}